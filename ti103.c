@@ -8,7 +8,21 @@
 #include <ctype.h>
 #include <string.h>
 #include <time.h>
-#include <sys/select.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spawn.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 typedef int	boolean;
 
@@ -23,11 +37,63 @@ typedef int	boolean;
 
 #define TI103_COMMAND		"$>28001"
 #define TI103_CKSUM		"CC#" /* Fake cksum */
+#define MAX_REPLY_BODY		256	/* longest reply we'll decode */
 
-#define MAX_OUTSTANDING_CMDS	50
+#define DEFAULT_VERIFY_TIMEOUT	5000	/* msecs to see our command come back */
+#define DEFAULT_VERIFY_RETRIES	2	/* times to send it again if not */
+#define MAX_FRAME_UNITS		8	/* addresses in one TI103 frame */
+#define MAX_PENDING_CMDS	512	/* commands waiting to be batched */
+#define DEFAULT_PACE		1000	/* msecs between command frames */
 
 #define MIN_RESET_INTERVAL	10	/* seconds */
 
+#define TX_BUFFER_SIZE		4096	/* bytes waiting for the UART */
+#define MAX_FRAME_SIZE		96	/* longest frame we send */
+#define DEFAULT_WINDOW		4	/* requests out at the TI103 at once */
+#define DEFAULT_XACT_TIMEOUT	2000	/* msecs to wait for a request's reply */
+#define DEFAULT_XACT_TRIES	3	/* times to send a command */
+
+#define DESC_ARENA_INIT		4096	/* bytes */
+#define DESC_HASH_SIZE		1024	/* power of 2 */
+
+#define DEFAULT_POLL_MIN	250	/* msecs between buffer reads when busy */
+#define DEFAULT_POLL_MAX	10000	/* msecs between buffer reads when idle */
+#define DEFAULT_POLL_DECAY	2.0	/* back off by this much each poll */
+#define DEFAULT_POLL_BURST	5000	/* msecs to stay busy after activity */
+#define MIN_RECONNECT_INTERVAL	1	/* seconds */
+#define MAX_RECONNECT_INTERVAL	60	/* seconds */
+
+#define MAX_EPOLL_EVENTS	8
+
+#define DEFAULT_MAX_JOBS	4	/* trigger commands run at once */
+#define MAX_QUEUED_JOBS		256	/* trigger commands waiting to run */
+#define MAX_EXPANDED_ARG	256	/* bytes in a substituted exec argument */
+#define MAX_EXPANDED_COMMAND	1024	/* bytes in a substituted shell command */
+
+#define COPROC_BUFFER_SIZE	65536	/* event lines waiting for the coprocess */
+#define MIN_COPROC_RESTART	1	/* seconds */
+#define MAX_COPROC_RESTART	60	/* seconds */
+#define COPROC_STABLE		60	/* seconds up before backoff resets */
+#define COPROC_GRACE		5	/* seconds to exit after its stdin closes */
+
+#define EVENTS_BUFFER_SIZE	65536	/* event lines waiting to be written */
+#define DEFAULT_EVENTS_FLUSH	1000	/* msecs an event waits at most */
+#define MIN_EVENTS_RETRY	1000	/* msecs before trying a failed write again */
+#define MAX_EVENTS_RETRY	60000	/* msecs */
+
+#define HISTORY_INDEX_STRIDE	256	/* records per history index entry */
+#define HISTORY_SCAN		4096	/* records read at once */
+#define DEFAULT_HISTORY_LAST	10	/* records a query shows */
+
+#define JOURNAL_COMPACT		4096	/* transitions between snapshots */
+
+#define SAVE_DELAY		2000	/* msecs after a change to save */
+#define RELOAD_DELAY		500	/* msecs after the file changes to read it */
+
+#define CONTROL_LINE_SIZE	1024	/* longest command from a client */
+#define CONTROL_TX_HIGH		65536	/* unsent reply bytes before we stop reading */
+#define MAX_CONTROL_CLIENTS	64
+
 typedef enum {
   undefined,
   state_on,
@@ -52,6 +118,8 @@ typedef enum {
   status_request,
 } func_value;
 
+#define NUM_FUNCTIONS	(status_request + 1)
+
 typedef enum {
   NONE,
   TRANSITION,
@@ -59,59 +127,505 @@ typedef enum {
   NEVER,
 } when_t;
 
+#define NUM_WHENS	(NEVER + 1)
+
+/*
+ * A command with %-substitutions, compiled once into literal spans of
+ * the original string and the placeholders between them.
+ */
+typedef enum {
+  TEMPLATE_LITERAL,
+  TEMPLATE_HOUSE,		/* %h */
+  TEMPLATE_UNIT,		/* %u */
+  TEMPLATE_FUNCTION,		/* %f */
+  TEMPLATE_DESCRIPTION,		/* %d */
+  TEMPLATE_TIME,		/* %t */
+} template_op_t;
+
+typedef struct template_op_ {
+  template_op_t		op;
+  char			*text;	/* TEMPLATE_LITERAL only */
+  int			len;
+} template_op;
+
+typedef struct x10_template_ {
+  int			nops;
+  template_op		ops[];
+} x10_template;
+
+/*
+ * Options given before a trigger's command:
+ *	remote	- only for commands from elsewhere, not ones we sent
+ *	rate=N/S - run at most N times in S seconds
+ */
+typedef struct trigger_opts_ {
+  boolean		remote;
+  int			rate;		/* rate=N/S - N runs ... */
+  int			per;		/* ... every S seconds, 0 for no limit */
+} trigger_opts;
+
 typedef struct x10_trigger_ {
   struct x10_trigger_	*next;
   int			house;
   int			unit;
   func_value		function;
   when_t		when;
+  unsigned long		seq;	/* order added, newest is highest */
+  trigger_opts		opts;
+  double		tokens;		/* runs left for "rate" */
+  long			refilled;	/* msecs */
+  unsigned long		limited;	/* runs skipped for "rate" */
   char			*command;
+  x10_template		*template;	/* command, compiled */
+  char			**argv;	/* "exec" triggers - command split up */
+  x10_template		**argv_templates; /* NULL where no '%' */
 } x10_trigger;
 
-typedef struct x10_desc_ {
-  struct x10_desc_	*next;
-  int			house;
-  int			unit;
-  char			*description;
-} x10_desc;
+extern char	**environ;
 
 boolean		verbose=FALSE;
 int		tty;
+
+/*
+ * Frames the UART wouldn't take yet.  Only whole frames go in here,
+ * and they're written out in order as the tty has room.
+ */
+char		tx_buffer[TX_BUFFER_SIZE];
+size_t		tx_head;
+size_t		tx_len;
+boolean		tx_watching;		/* waiting for room in the tty */
+unsigned long	tx_queued;
+unsigned long	tx_dropped;
+
+/*
+ * Every frame we send the TI103 gets exactly one "$<2800!...#" reply,
+ * and replies come back in the order the frames went out.  So each
+ * frame is a transaction: it waits in xact_waiting until there's room
+ * in the window, then sits in xact_flight until its reply comes back
+ * (the oldest in flight owns the next reply) or it times out.
+ * Commands are sent again after a timeout or a bad reply; polls
+ * aren't, since the next poll will do just as well.
+ */
+typedef enum {
+  XACT_COMMAND,
+  XACT_POLL
+} xact_kind;
+
+typedef struct ti103_xact {
+  struct ti103_xact	*next;
+  xact_kind		kind;
+  char			frame[MAX_FRAME_SIZE];
+  int			len;
+  long			sent;		/* msecs */
+  int			tries;
+} ti103_xact;
+
+ti103_xact	*xact_waiting;
+ti103_xact	**xact_waiting_tail = &xact_waiting;
+ti103_xact	*xact_flight;
+ti103_xact	**xact_flight_tail = &xact_flight;
+int		xact_in_flight;
+int		xact_queued;
+int		xact_polls;		/* polls waiting or in flight */
+int		xact_window = DEFAULT_WINDOW;
+long		xact_timeout = DEFAULT_XACT_TIMEOUT;
+int		xact_tries = DEFAULT_XACT_TRIES;
+int		xact_timer_fd;
+unsigned long	xact_sent;
+unsigned long	xact_acked;
+unsigned long	xact_retries;
+unsigned long	xact_timeouts;
+unsigned long	xact_failed;
 FILE		*log_file;
-FILE		*stdin_file;
-FILE		*events_fd;
 x10_trigger	*trigger_list;
-x10_desc	*desc_list;
+
+/*
+ * Triggers are also indexed by house, unit, function and "when" so
+ * an incoming event finds its triggers without walking trigger_list.
+ * House/unit 0 is "all".  A "never" covers every function for its
+ * house/unit, so those are indexed by house/unit alone as well.
+ */
+x10_trigger	*trigger_index[17][17][NUM_FUNCTIONS][NUM_WHENS];
+x10_trigger	*never_index[17][17];
+unsigned long	trigger_seq;
+
+/*
+ * Descriptions are a [house][unit] table of offsets into one arena
+ * of strings.  Every cell always has a string - the generic "A  1"
+ * name until someone gives it a real one - so a lookup is just an
+ * index.  Strings are interned through desc_hash, so the same one is
+ * only stored once, and the arena is compacted rather than freed
+ * piecemeal.
+ */
+char		*desc_arena;
+size_t		desc_arena_size;
+size_t		desc_arena_used;
+unsigned int	desc_hash[DESC_HASH_SIZE];	/* offset + 1, 0 is empty */
+int		desc_strings;			/* entries in desc_hash */
+unsigned int	desc_offset[17][17];
+unsigned int	desc_default[17][17];
+boolean		desc_set[17][17];
 
 //char 	*device="/dev/ttyUSB0";
 char 	*device="/dev/tty.KeySerial1";
 //char 	*device="/dev/cu.usbserial-A1023OBJ";
-char	ti103_output[512];
-char	*ti103_output_ptr;
+
+/*
+ * Reply parser.  Bytes are fed in as they're read and the parser
+ * carries on from where it left off, so a reply can arrive in any
+ * number of pieces.  The last two characters before the '#' are the
+ * checksum, so each body character is held back two places until we
+ * know it isn't one of them.
+ */
+typedef enum {
+  RX_HUNT,			/* waiting for a '$' */
+  RX_HEADER,			/* matching "$<2800!" */
+  RX_BODY			/* up to the '#' */
+} rx_state_value;
+
+rx_state_value	rx_state;
+int		rx_header_len;
+char		rx_body[MAX_REPLY_BODY + 1];
+int		rx_body_len;
+char		rx_hold[2];
+int		rx_held;
+int		rx_sum;
+unsigned long	rx_frames;
+unsigned long	rx_bad_checksums;
+unsigned long	rx_resyncs;
 /* Remember - unit numbers are 1-16, arrays start at 0 */
-int	house_unit[17];
+unsigned int	house_units[17];	/* bit per unit addressed, per house */
 state_value	states[17][17];
 boolean	ti103_read_waiting;
 char	*command_file=NULL;
 char	*events_file=NULL;
 
 /*
- * We save ti103 commands which we have written so we can verify
- * that we actually see them on the wire.  If we don't,
- * then it may mean that the ti103 device has been unplugged.
+ * Events are formatted into events_buffer and written out when it's
+ * half full, or "events_flush" msecs after the first one went in, so
+ * a burst of events is one write.  The file is rotated - renamed with
+ * the time and started again - when it gets past "events_rotate_size"
+ * or, with "daily", when the day changes.  SIGHUP reopens it, for
+ * rotating it from outside.  If it can't be opened or written, it's
+ * tried again "events_retry" msecs later, twice as long each time.
+ */
+int		events_fd = -1;
+char		events_buffer[EVENTS_BUFFER_SIZE];
+size_t		events_head;
+size_t		events_len;
+int		events_timer_fd;
+boolean		events_json;
+boolean		events_daily;
+long		events_flush = DEFAULT_EVENTS_FLUSH;
+off_t		events_rotate_size;	/* bytes, 0 for no limit */
+off_t		events_size;		/* bytes in the file now */
+int		events_day;		/* tm_yday it was opened */
+boolean		events_failed;		/* can't open it, said so already */
+long		events_retry;		/* msecs, 0 if the last write worked */
+unsigned long	events_logged;
+unsigned long	events_writes;
+unsigned long	events_dropped;
+unsigned long	events_rotations;
+
+/*
+ * History store.  Every event is appended to "history_file" as a
+ * fixed size record, so record n is at n * sizeof(history_record).
+ * Each record points back at the device's previous one, and the time
+ * of every HISTORY_INDEX_STRIDE'th record is kept in history_index.
+ * A query for one device follows its chain back from history_last; a
+ * query for a time range binary searches the index and reads on from
+ * there.  Neither depends on how big the file has got.  The chain heads
+ * are saved in "<history_file>.heads" every HISTORY_INDEX_STRIDE records
+ * and on the way out, so opening the store only reads what was added
+ * after they were last saved.
+ */
+#define HISTORY_NONE	0xffffffffU
+
+typedef struct history_record_ {
+  int64_t		msecs;		/* since the epoch */
+  uint32_t		prev;		/* device's previous record */
+  uint8_t		house;
+  uint8_t		unit;
+  uint8_t		function;
+  uint8_t		origin;		/* 0 from elsewhere, else priority + 1 */
+} history_record;
+
+char		*history_file;
+int		history_fd = -1;
+uint32_t	history_count;
+uint32_t	history_last[17][17];
+int64_t		*history_index;
+uint32_t	history_index_size;	/* entries allocated */
+int		history_heads_fd = -1;
+
+typedef struct history_heads_ {
+  uint32_t		count;		/* records when they were saved */
+  uint32_t		last[17][17];
+  uint32_t		check;
+} history_heads;
+
+/*
+ * State journal.  Every change in states[][] is appended to
+ * "journal_file", and every JOURNAL_COMPACT changes the file is
+ * replaced by a snapshot - one record per known device - so it never
+ * holds more than a few thousand records.  On startup it's replayed
+ * into states[][], so we know where everything was straight away.
+ */
+typedef struct journal_record_ {
+  uint32_t		secs;		/* since the epoch */
+  uint8_t		house;
+  uint8_t		unit;
+  uint8_t		state;
+  uint8_t		check;
+} journal_record;
+
+char		*journal_file;
+int		journal_fd = -1;
+uint32_t	journal_time[17][17];	/* secs of the last change */
+unsigned long	journal_appended;	/* since the last snapshot */
+unsigned long	journal_snapshots;
+
+/*
+ * The commands file is saved SAVE_DELAY msecs after the last of a
+ * burst of changes to the triggers or descriptions.  A child process
+ * does the writing, so a big rule set doesn't hold up the main loop.
+ */
+int		save_timer_fd;
+pid_t		save_pid;
+boolean		save_again;		/* changed while saving */
+boolean		save_loading;		/* reading the commands file */
+unsigned long	saves;
+unsigned long	saves_failed;
+
+/*
+ * The commands file is watched, through its directory so editors that
+ * write a new file and rename it are seen too.  RELOAD_DELAY msecs
+ * after it changes, the triggers and descriptions in it are read into
+ * a staging list - add_trigger() and add_desc() fill that in rather
+ * than the live tables while "reload_staging" is set - then compared
+ * with the live ones, and only the differences applied, all in one go.
+ * A file that's the same one we last read or saved is left alone.
+ */
+typedef struct reload_rule_ {
+  struct reload_rule_	*next;
+  int			house;
+  int			unit;
+  func_value		func;
+  when_t		when;
+  boolean		exec;
+  trigger_opts		opts;
+  char			*command;	/* NULL for none */
+} reload_rule;
+
+char		*commands_read;		/* file given at startup */
+int		inotify_fd = -1;
+int		reload_wd = -1;
+int		reload_timer_fd;
+boolean		reload_staging;
+reload_rule	*reload_rules;
+char		*reload_descs[17][17];
+struct stat	reload_known;		/* the version we have */
+unsigned long	reloads;
+
+/*
+ * Control socket.  Clients connect to "control_path" and send the
+ * same commands as stdin, a line at a time.  Whatever a command would
+ * have logged - STATUS, STATS and so on with no file, errors - goes
+ * back to that client instead, ended by a line with just "." (output
+ * lines starting with "." get another one in front).  Each client has
+ * its own buffers; we stop reading from one that isn't reading its
+ * replies, so it only holds itself up.
+ */
+typedef struct control_client_ {
+  struct control_client_	*next;
+  int				fd;
+  char				rx[CONTROL_LINE_SIZE];
+  int				rx_len;
+  char				*tx;
+  size_t			tx_head;
+  size_t			tx_len;
+  size_t			tx_size;
+  uint32_t			events;		/* what we're waiting for */
+} control_client;
+
+char		*control_path;
+int		control_fd = -1;
+control_client	*control_clients;
+int		control_nclients;
+unsigned long	control_accepted;
+unsigned long	control_commands;
+
+/*
+ * Everything the main loop waits on goes through one epoll set:
+ * stdin, the tty, a signalfd and timerfds for the buffer poll and
+ * for retrying the device open.  Nothing wakes us unless there is
+ * something to do.
+ */
+int	epoll_fd;
+int	signal_fd;
+int	poll_timer_fd;
+int	reconnect_timer_fd;
+int	reconnect_interval;
+
+/*
+ * Buffer polling is adaptive.  After any frame we read or command we
+ * write, poll every "poll_min" msecs for "poll_burst" msecs, then back
+ * off by "poll_decay" each time until we're polling every "poll_max".
+ */
+long		poll_min = DEFAULT_POLL_MIN;
+long		poll_max = DEFAULT_POLL_MAX;
+double		poll_decay = DEFAULT_POLL_DECAY;
+long		poll_burst = DEFAULT_POLL_BURST;
+long		poll_interval;
+long		last_activity;
+unsigned long	polls_issued;
+unsigned long	poll_frames;
+
+/*
+ * Trigger commands run as child processes without us waiting for
+ * them.  At most "max_jobs" run at once, and only one at a time for
+ * any house/unit, so commands for a device always run in the order
+ * their events arrived.  Children are reaped on SIGCHLD.
+ */
+typedef struct trigger_job_ {
+  struct trigger_job_	*next;
+  int			house;
+  int			unit;
+  pid_t			pid;
+  long			started;	/* msecs */
+  char			*command;
+  char			**argv;		/* "exec" - run without a shell */
+} trigger_job;
+
+trigger_job	*job_queue;		/* waiting to run, oldest first */
+trigger_job	*job_queue_tail;
+trigger_job	*jobs_running;
+int		jobs_queued;
+int		jobs_active;
+int		max_jobs = DEFAULT_MAX_JOBS;
+boolean		job_busy[17][17];
+unsigned long	jobs_started;
+unsigned long	jobs_dropped;
+
+/*
+ * A "coprocess" is a handler we start once and keep running, writing
+ * a line to its stdin for each event instead of starting a new process
+ * per event.  Lines queue in coproc_buffer while the pipe is full.  If
+ * it dies, it's restarted after a backoff.
  */
+char		*coproc_command;
+pid_t		coproc_pid;
+int		coproc_fd = -1;		/* its stdin */
+boolean		coproc_watching;	/* waiting for room in the pipe */
+char		coproc_buffer[COPROC_BUFFER_SIZE];
+size_t		coproc_head;
+size_t		coproc_len;
+int		coproc_timer_fd;
+int		coproc_backoff = MIN_COPROC_RESTART;
+long		coproc_started;
+x10_template	*coproc_template;
+unsigned long	coproc_lines;
+unsigned long	coproc_dropped;
+unsigned long	coproc_restarts;
+
+/*
+ * Outbound commands are sent in priority order: someone waiting on
+ * the command line comes first, then things we decided to send
+ * ourselves (resends), then resets of everything to its known state.
+ */
+typedef enum {
+  PRI_INTERACTIVE,
+  PRI_TRIGGERED,
+  PRI_SWEEP,
+  NUM_PRIORITIES
+} priority_t;
+
 typedef struct ti103_commands_ {
   char		house;
   int		unit;
   func_value	func;
+  priority_t	priority;
+  long		queued;		/* msecs */
 } ti103_commands;
-ti103_commands ti103_cmds[MAX_OUTSTANDING_CMDS];
-int ti103_cmds_write;
-int ti103_cmds_verify;
+
+/*
+ * We note when we write each command so we can verify that we
+ * actually see it on the wire.  If we don't see it within
+ * "verify_timeout" it's sent again, up to "verify_retries" times; a
+ * module that keeps missing commands is probably out of range, and
+ * none at all coming back may mean the ti103 has been unplugged.
+ */
+long		verify_sent[17][17][NUM_FUNCTIONS];	/* msecs, 0 if not waiting */
+int		verify_tries[17][17][NUM_FUNCTIONS];
+priority_t	verify_origin[17][17][NUM_FUNCTIONS];	/* who sent it */
+int		verify_outstanding;
+long		verify_timeout = DEFAULT_VERIFY_TIMEOUT;
+int		verify_retries = DEFAULT_VERIFY_RETRIES;
+int		verify_timer_fd;
+unsigned long	verify_seen[17][17];
+unsigned long	verify_missed[17][17];
+unsigned long	verify_failed[17][17];
+long		verify_rtt_total[17][17];	/* msecs */
+long		verify_rtt_max[17][17];
+
+/*
+ * Commands waiting to go out, oldest first.  They're sent by
+ * send_x10_commands(), which puts commands for the same house code
+ * and function into one frame ("A01A02A05 AONAON") since each frame
+ * costs about a second on the powerline.  For the same reason frames
+ * are paced "pace" msecs apart, and a command that's still waiting
+ * when a newer ON or OFF for the same device comes along is dropped.
+ */
+ti103_commands pending_cmds[MAX_PENDING_CMDS];
+int pending_count;
+
+/*
+ * With "suppress" set, an ON or OFF from the command line isn't sent
+ * if the device was seen going into that state on the wire within the
+ * last "suppress_window" seconds.  "force" on the line sends it anyway.
+ */
+long		state_seen[17][17];	/* msecs, 0 if never */
+int		suppress_window;	/* seconds, 0 is off */
+unsigned long	suppressed;
+
+/*
+ * Some devices send the same thing over and over (motion sensors, some
+ * switches).  A repeat of a device's last function less than its
+ * debounce window after the previous one changes nothing and runs
+ * nothing.  Each repeat restarts the window, so a device chattering
+ * away costs one run however long it keeps it up.
+ */
+long		debounce_default;		/* msecs, 0 is off */
+long		debounce_msecs[17][17];		/* 0 is use the default */
+long		debounce_last[17][17];		/* msecs */
+func_value	debounce_func[17][17];
+unsigned long	debounced[17][17];
+
+long		pace = DEFAULT_PACE;
+long		last_frame_sent;	/* msecs */
+int		sched_timer_fd;
+int		sched_depth[NUM_PRIORITIES];
+unsigned long	sched_sent[NUM_PRIORITIES];
+unsigned long	sched_superseded[NUM_PRIORITIES];
+unsigned long	sched_dropped;
+long		sched_wait_total[NUM_PRIORITIES];	/* msecs */
+long		sched_wait_max[NUM_PRIORITIES];
+char		*priority_names[NUM_PRIORITIES] = {
+  "interactive", "triggered", "sweep"
+};
 
 static void dump_and_exit(int);
-static boolean function_trigger (int, int, func_value, when_t);
-static void all_trigger (int, int, func_value);
+static void poll_activity(void);
+static void reap_jobs(void);
+static void coproc_flush(void);
+static void coproc_exited(int);
+static void save_exited(int);
+static void reload_note_file(void);
+static void reload_watch(void);
+static void init_descs(void);
+static void send_x10_commands(void);
+static boolean function_trigger (int, int, func_value, when_t, boolean);
+static void all_trigger (int, int, func_value, boolean);
 void perform_trigger (x10_trigger *, int, int, func_value);
 
 /*
@@ -157,191 +671,667 @@ static int
 init_ti103 (void) {
   struct termios	termios;
   int			state;
-  int			i;
 
   /*
-   * Init. our indexes for saving written commands
-   * and for verifying them.
+   * Forget about written commands we were waiting to see
    */
-  ti103_cmds_write = 0;
-  ti103_cmds_verify = 0;
-  for (i = 0; i < MAX_OUTSTANDING_CMDS; i++) {
-    ti103_cmds[i].house = name2house('A');
-    ti103_cmds[i].unit = 0;
-    ti103_cmds[i].func = no_function;
-  }
+  bzero(verify_sent, sizeof(verify_sent));
+  bzero(verify_tries, sizeof(verify_tries));
+  verify_outstanding = 0;
 
-  tty = open(device, O_NONBLOCK | O_RDWR);
+  tty = open(device, O_NONBLOCK | O_RDWR | O_CLOEXEC);
   if (tty == -1) {
     fprintf(log_file, "Can't open Ti103 device - errno=%d\n", errno);
     return -1;			/* no such device present */
   }
 
   /*
-   * Set speed
+   * Set speed, and raw mode - no echo, no line editing, no CR/NL
+   * mangling, 8 bits through untouched.  The tty is non-blocking and
+   * read when epoll says there's something there; replies are short,
+   * and the reply parser puts them back together however they arrive.
    */
   if (tcgetattr(tty, &termios) < 0) {
     fprintf(log_file, "! Error getting speed errno=%d\n", errno);
+    close(tty);
     return -1;
   }
 
+  cfmakeraw(&termios);
   cfsetspeed(&termios, B9600);
+#ifdef CCAR_OFLOW
   termios.c_cflag &= ~(CCAR_OFLOW|CDSR_OFLOW|CDTR_IFLOW|CRTS_IFLOW);
-  termios.c_cflag |= CLOCAL;
+#endif
+#ifdef CRTSCTS
+  termios.c_cflag &= ~CRTSCTS;
+#endif
+  termios.c_cflag |= CLOCAL | CREAD;
 
   if (tcsetattr(tty, TCSANOW, &termios) < 0) {
     fprintf(log_file, "! Error getting speed errno=%d\n", errno);
+    close(tty);
     return -1;
   }
 
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+  {
+    struct serial_struct	serial;
+
+    /*
+     * USB serial adapters otherwise hold on to input for up to 16ms
+     * hoping for more.  Not all drivers support this; that's fine.
+     */
+    if (ioctl(tty, TIOCGSERIAL, &serial) == 0) {
+      serial.flags |= ASYNC_LOW_LATENCY;
+      (void)ioctl(tty, TIOCSSERIAL, &serial);
+    }
+  }
+#endif
+
+  tcflush(tty, TCIOFLUSH);	/* whatever was left from before */
+
   return tty;
 }
 
+/*
+ * Add a file descriptor to the main loop's epoll set.
+ */
+static boolean
+reactor_add (int fd, uint32_t events) {
+  struct epoll_event	ev;
+
+  bzero(&ev, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(log_file, "! Can't watch fd %d - errno=%d\n", fd, errno);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Change what we're waiting for on a file descriptor.
+ */
+static void
+reactor_mod (int fd, uint32_t events) {
+  struct epoll_event	ev;
+
+  bzero(&ev, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  (void)epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * Remove a file descriptor from the main loop's epoll set.
+ */
+static void
+reactor_del (int fd) {
+
+  (void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Arm a timerfd to go off in "msecs" milliseconds, and every
+ * "msecs" after that if "periodic".  Zero disarms it.
+ */
+static void
+arm_timer (int fd, long msecs, boolean periodic) {
+  struct itimerspec	its;
+
+  bzero(&its, sizeof(its));
+  its.it_value.tv_sec = msecs / 1000;
+  its.it_value.tv_nsec = (msecs % 1000) * 1000000;
+  if (periodic) {
+    its.it_interval = its.it_value;
+  }
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/*
+ * Consume an expiration from a timerfd so it stops being readable.
+ */
+static void
+ack_timer (int fd) {
+  uint64_t	expirations;
+
+  (void)read(fd, &expirations, sizeof(expirations));
+}
+
+/*
+ * Milliseconds on the monotonic clock, for measuring intervals.
+ */
+static long
+now_msecs (void) {
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 /*
  * Init's
  * Open a log file.
- * Open stdin with fopen, so we an use fflush
- * Try to catch as many signals as possible so we can dump
- * commands and save state.
+ * Set up the epoll set the main loop waits on.
+ * Block the signals we care about and take them through a signalfd
+ * instead, so we can dump commands and save state from the main
+ * loop rather than from inside a signal handler.
  */
 static void
 init (void) {
+  sigset_t	mask;
 
-  ti103_output_ptr = &ti103_output[0];
-  bzero(house_unit, sizeof(house_unit));
+  rx_state = RX_HUNT;
+  bzero(house_units, sizeof(house_units));
   bzero(states, sizeof(states));
   ti103_read_waiting = FALSE;
 
   log_file = fdopen(STDOUT_FILENO, "a");
   setlinebuf(log_file);
 
-  stdin_file = fdopen(STDIN_FILENO, "r");
-
   trigger_list = NULL;
+  init_descs();
   tty = -1;
+  reconnect_interval = MIN_RECONNECT_INTERVAL;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    fprintf(log_file, "! Can't create epoll set - errno=%d\n", errno);
+    exit(1);
+  }
 
   /*
    * Catch some signals
    */
-  signal(SIGHUP, dump_and_exit);
-  signal(SIGINT, dump_and_exit);
-  signal(SIGQUIT, dump_and_exit);
-  signal(SIGTERM, dump_and_exit);
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGQUIT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  reactor_add(signal_fd, EPOLLIN);
+
+  poll_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(poll_timer_fd, EPOLLIN);
+  reconnect_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(reconnect_timer_fd, EPOLLIN);
+  coproc_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(coproc_timer_fd, EPOLLIN);
+  xact_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(xact_timer_fd, EPOLLIN);
+  verify_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				   TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(verify_timer_fd, EPOLLIN);
+  sched_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(sched_timer_fd, EPOLLIN);
+  events_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				   TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(events_timer_fd, EPOLLIN);
+  save_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(save_timer_fd, EPOLLIN);
+  reload_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				   TFD_NONBLOCK | TFD_CLOEXEC);
+  reactor_add(reload_timer_fd, EPOLLIN);
+
+  /*
+   * A coprocess going away mustn't take us with it
+   */
+  signal(SIGPIPE, SIG_IGN);
 }
 
 /*
- * Write a command to the Ti103
+ * Write out as much of the transmit queue as the tty will take.  Once
+ * it's empty we can stop waiting for room.
+ */
+static void
+tx_flush (void) {
+  struct iovec	iov[2];
+  int		iovcnt;
+  ssize_t	ret;
+
+  while (tx_len > 0 && tty != -1) {
+    iov[0].iov_base = &tx_buffer[tx_head];
+    iov[0].iov_len = tx_len;
+    iovcnt = 1;
+    if (tx_head + tx_len > sizeof(tx_buffer)) {
+      iov[0].iov_len = sizeof(tx_buffer) - tx_head;
+      iov[1].iov_base = tx_buffer;
+      iov[1].iov_len = tx_len - iov[0].iov_len;
+      iovcnt = 2;
+    }
+
+    ret = writev(tty, iov, iovcnt);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN) {
+	fprintf(log_file, "! Write to TI103 failed (%d)\n", errno);
+      }
+      break;
+    }
+
+    tx_head = (tx_head + ret) % sizeof(tx_buffer);
+    tx_len -= ret;
+  }
+
+  if (tx_len == 0) {
+    tx_head = 0;
+  }
+  if (tty != -1 && tx_watching != (tx_len > 0)) {
+    tx_watching = (tx_len > 0);
+    reactor_mod(tty, tx_watching ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+  }
+}
+
+
+/*
+ * Write a frame to the Ti103 in one go.  Whatever the UART won't take
+ * right now is queued behind anything already waiting, and goes out
+ * when there's room.  A frame is queued whole or not at all, so a full
+ * queue loses a frame rather than sending half of one.
  */
 static boolean
-write_ti103 (char *command, int size) {
-  int	ret;
+write_ti103_frame (struct iovec *iov, int iovcnt) {
+  size_t	size, done, len, tail, first;
+  ssize_t	ret;
+  int		i;
 
   if (tty == -1)
     return FALSE;
 
-  if (verbose)
-    fprintf(log_file, "Writing ti103(%d): '%s'\n", tty, command);
+  size = 0;
+  for (i = 0; i < iovcnt; i++) {
+    size += iov[i].iov_len;
+    if (verbose)
+      fprintf(log_file, "Writing ti103(%d): '%.*s'\n", tty,
+	      (int)iov[i].iov_len, (char *)iov[i].iov_base);
+  }
 
-  ret = write(tty, command, size);
-  if (ret != size) {
-    fprintf(log_file, "! Got '%d' when I wrote '%d' bytes (%d)\n",
-	    ret, size, errno);
+  if (size > sizeof(tx_buffer) - tx_len) {
+    fprintf(log_file, "! TI103 output queue full, dropping %d bytes\n",
+	    (int)size);
+    fflush(log_file);
+    tx_dropped++;
     return FALSE;
   }
-  fflush(log_file);
+
+  done = 0;
+  if (tx_len == 0) {
+    do {
+      ret = writev(tty, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      if (errno != EAGAIN) {
+	fprintf(log_file, "! Got '%d' when I wrote '%d' bytes (%d)\n",
+		(int)ret, (int)size, errno);
+	fflush(log_file);
+	return FALSE;
+      }
+      ret = 0;
+    }
+    done = ret;
+  }
+
+  if (done < size) {
+    /*
+     * Queue the rest, skipping over whatever already went out
+     */
+    tx_queued++;
+    for (i = 0; i < iovcnt; i++) {
+      len = iov[i].iov_len;
+      if (done >= len) {
+	done -= len;
+	continue;
+      }
+      len -= done;
+
+      tail = (tx_head + tx_len) % sizeof(tx_buffer);
+      first = sizeof(tx_buffer) - tail;
+      if (first > len) {
+	first = len;
+      }
+      memcpy(&tx_buffer[tail], (char *)iov[i].iov_base + done, first);
+      memcpy(tx_buffer, (char *)iov[i].iov_base + done + first, len - first);
+      tx_len += len;
+      done = 0;
+    }
+    tx_flush();
+  }
 
   return TRUE;
 }
 
+
+/*
+ * Write a command to the Ti103
+ */
+static boolean
+write_ti103 (char *command, int size) {
+  struct iovec	iov;
+
+  iov.iov_base = command;
+  iov.iov_len = size;
+  return write_ti103_frame(&iov, 1);
+}
+
+
 /*
- * Write command to Ti103 which tells it to send us whatever
- * X10 commands it has saved in its buffer.  We do this every
- * 5 seconds on an alarm signal
+ * Time out the oldest request in flight, or nothing if there isn't one.
  */
 static void
-write_ti103_read_buffer (int sig) {
+xact_arm (void) {
+  long		left;
 
-  if (tty == -1)
+  if (xact_flight == NULL) {
+    arm_timer(xact_timer_fd, 0, FALSE);
     return;
+  }
 
-  write_ti103(TI103_READ_BUFFER, sizeof(TI103_READ_BUFFER)-1);
-  ti103_read_waiting = TRUE;
-
-  alarm(5);
+  left = xact_flight->sent + xact_timeout - now_msecs();
+  arm_timer(xact_timer_fd, left > 0 ? left : 1, FALSE);
 }
 
 
 /*
- * Translate a "state" to a character string for printing.
+ * A transaction is done with, one way or another.
  */
-char *
-state2name (state_value state) {
-  switch (state) {
-  case state_on:
-    return "On";
-
-  case state_off:
-    return "Off";
+static void
+xact_free (ti103_xact *xact) {
 
-  case undefined:
-    return "Null";
+  if (xact->kind == XACT_POLL) {
+    xact_polls--;
   }
+  free(xact);
 }
 
 
 /*
- * Translate a function to a character string for printing
+ * Send waiting requests while there's room in the window.
  */
-static char *
-func2name (func_value func) {
+static void
+xact_pump (void) {
+  ti103_xact	*xact;
+
+  while (xact_waiting && xact_in_flight < xact_window) {
+    xact = xact_waiting;
+    xact_waiting = xact->next;
+    if (xact_waiting == NULL) {
+      xact_waiting_tail = &xact_waiting;
+    }
+    xact_queued--;
 
-  switch ( func ) {
-  case no_function:
-    return "";
-  case on:
-    return "ON";
-  case off:
-    return "OFF";
-  case dim:
-    return "DIM";
-  case bright:
-    return "BGT";
-  case all_lights_on:
-    return "ALN";
-  case all_units_off:
-    return "AUF";
-  case all_lights_off:
-    return "ALF";
-  case hail_request:
-    return "HRQ";
-  case hail_ack:
-    return "HAK";
-  case preset_dim_0:
-    return "PR0";
-  case preset_dim_1:
-    return "PR1";
-  case status_on:
-    return "SON";
-  case status_off:
-    return "SOF";
-  case status_request:
-    return "SRQ";
+    if (!write_ti103(xact->frame, xact->len)) {
+      xact_failed++;
+      xact_free(xact);
+      continue;
+    }
+
+    xact->sent = now_msecs();
+    xact->tries++;
+    xact->next = NULL;
+    *xact_flight_tail = xact;
+    xact_flight_tail = &xact->next;
+    xact_in_flight++;
+    xact_sent++;
   }
+
+  xact_arm();
 }
 
 
 /*
- * Parses an x10 function from a character string to a function value.
- * Side-effects:
- *	sets "*astate" if func was on of off
- * Considerations:
- *	input string MUST be in CAPS
+ * Put a list of requests back at the front of the waiting queue to be
+ * sent again, keeping their order, unless they've had enough tries.
  */
-static func_value
-parse_ti103_function (state_value *astate, char **cp) {
-  char		*cptr;
-  state_value	new_state;
-  func_value	function;
+static void
+xact_retry (ti103_xact *list) {
+  ti103_xact	*xact, *next;
+  ti103_xact	*head, **tail;
+
+  head = NULL;
+  tail = &head;
+  for (xact = list; xact; xact = next) {
+    next = xact->next;
+    if (xact->kind == XACT_POLL) {
+      xact_free(xact);
+      continue;
+    }
+    if (xact->tries >= xact_tries) {
+      fprintf(log_file, "! Giving up on TI103 frame '%.*s'\n",
+	      xact->len, xact->frame);
+      xact_failed++;
+      xact_free(xact);
+      continue;
+    }
+
+    xact_retries++;
+    xact_queued++;
+    *tail = xact;
+    tail = &xact->next;
+  }
+
+  if (head) {
+    *tail = xact_waiting;
+    if (xact_waiting == NULL) {
+      xact_waiting_tail = tail;
+    }
+    xact_waiting = head;
+  }
+}
+
+
+/*
+ * Queue a frame for the TI103, gathered up from "iov".
+ */
+static boolean
+xact_submit (xact_kind kind, struct iovec *iov, int iovcnt) {
+  ti103_xact	*xact;
+  int		i;
+
+  if (tty == -1)
+    return FALSE;
+
+  xact = (ti103_xact *)malloc(sizeof(ti103_xact));
+  if (xact == NULL) {
+    fprintf(log_file, "! Out of memory for a TI103 request\n");
+    return FALSE;
+  }
+
+  xact->next = NULL;
+  xact->kind = kind;
+  xact->len = 0;
+  xact->sent = 0;
+  xact->tries = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (xact->len + iov[i].iov_len > sizeof(xact->frame)) {
+      fprintf(log_file, "! TI103 frame too long\n");
+      free(xact);
+      return FALSE;
+    }
+    memcpy(&xact->frame[xact->len], iov[i].iov_base, iov[i].iov_len);
+    xact->len += iov[i].iov_len;
+  }
+
+  if (kind == XACT_POLL) {
+    xact_polls++;
+  }
+  *xact_waiting_tail = xact;
+  xact_waiting_tail = &xact->next;
+  xact_queued++;
+
+  xact_pump();
+  return TRUE;
+}
+
+
+/*
+ * A reply has come in - it belongs to the oldest request in flight.
+ * If the reply was garbled, a command is sent again.  Returns the kind
+ * of request it answered.
+ */
+static xact_kind
+xact_reply (boolean good) {
+  ti103_xact	*xact;
+  xact_kind	kind;
+
+  xact = xact_flight;
+  if (xact == NULL) {
+    if (tty != -1) {
+      fprintf(log_file, "! TI103 reply with nothing outstanding\n");
+    }
+    return XACT_COMMAND;
+  }
+
+  xact_flight = xact->next;
+  if (xact_flight == NULL) {
+    xact_flight_tail = &xact_flight;
+  }
+  xact_in_flight--;
+  kind = xact->kind;
+
+  if (good) {
+    xact_acked++;
+    xact_free(xact);
+  } else {
+    xact->next = NULL;
+    xact_retry(xact);
+  }
+
+  xact_pump();
+  send_x10_commands();		/* room for another */
+  return kind;
+}
+
+
+/*
+ * The oldest request has had no reply.  We can't tell which of the
+ * later ones any late replies would belong to, so everything in
+ * flight goes back to be sent again.
+ */
+static void
+xact_timer (void) {
+  ti103_xact	*list;
+
+  if (xact_flight == NULL ||
+      xact_flight->sent + xact_timeout > now_msecs()) {
+    xact_arm();
+    return;
+  }
+
+  fprintf(log_file, "! No reply from TI103 for '%.*s'\n",
+	  xact_flight->len, xact_flight->frame);
+  xact_timeouts++;
+
+  list = xact_flight;
+  xact_flight = NULL;
+  xact_flight_tail = &xact_flight;
+  xact_in_flight = 0;
+  xact_retry(list);
+  xact_pump();
+}
+
+
+/*
+ * Drop every request - the device has gone.
+ */
+static void
+xact_reset (void) {
+  ti103_xact	*xact, *next;
+
+  for (xact = xact_flight; xact; xact = next) {
+    next = xact->next;
+    xact_free(xact);
+  }
+  for (xact = xact_waiting; xact; xact = next) {
+    next = xact->next;
+    xact_free(xact);
+  }
+  xact_flight = NULL;
+  xact_flight_tail = &xact_flight;
+  xact_waiting = NULL;
+  xact_waiting_tail = &xact_waiting;
+  xact_in_flight = 0;
+  xact_queued = 0;
+  arm_timer(xact_timer_fd, 0, FALSE);
+}
+
+/*
+ * Translate a "state" to a character string for printing.
+ */
+char *
+state2name (state_value state) {
+  switch (state) {
+  case state_on:
+    return "On";
+
+  case state_off:
+    return "Off";
+
+  case undefined:
+    return "Null";
+  }
+}
+
+
+/*
+ * Translate a function to a character string for printing
+ */
+static char *
+func2name (func_value func) {
+
+  switch ( func ) {
+  case no_function:
+    return "";
+  case on:
+    return "ON";
+  case off:
+    return "OFF";
+  case dim:
+    return "DIM";
+  case bright:
+    return "BGT";
+  case all_lights_on:
+    return "ALN";
+  case all_units_off:
+    return "AUF";
+  case all_lights_off:
+    return "ALF";
+  case hail_request:
+    return "HRQ";
+  case hail_ack:
+    return "HAK";
+  case preset_dim_0:
+    return "PR0";
+  case preset_dim_1:
+    return "PR1";
+  case status_on:
+    return "SON";
+  case status_off:
+    return "SOF";
+  case status_request:
+    return "SRQ";
+  }
+}
+
+
+/*
+ * Parses an x10 function from a character string to a function value.
+ * Side-effects:
+ *	sets "*astate" if func was on of off
+ * Considerations:
+ *	input string MUST be in CAPS
+ */
+static func_value
+parse_ti103_function (state_value *astate, char **cp) {
+  char		*cptr;
+  state_value	new_state;
+  func_value	function;
 
   cptr = *cp;
   new_state = undefined;	/* init. */
@@ -409,208 +1399,359 @@ parse_ti103_function (state_value *astate, char **cp) {
  */
 
 /*
- * Add a new description to the linked list of descriptions by
- * house code and unit number.
+ * Hash a string for desc_hash
  */
-static x10_desc *
-new_desc (int house, int unit, char *cp) {
-  x10_desc	*desc;
+static unsigned int
+desc_hash_string (char *cp) {
+  unsigned int	h;
+
+  h = 2166136261u;		/* FNV-1a */
+  while (*cp) {
+    h ^= (unsigned char)*cp++;
+    h *= 16777619;
+  }
 
-  desc = malloc(sizeof(*desc));
-  if (!desc)
-    return NULL;
+  return h;
+}
 
-  desc->house = house;
-  desc->unit = unit;
-  desc->description = malloc(strlen(cp)+1);
-  if (!desc->description) {
-    free(desc);
-    return NULL;
+
+/*
+ * Find a string in the arena, adding it if it isn't there yet.
+ * Returns its offset.
+ */
+static unsigned int
+desc_store (char *cp) {
+  unsigned int	h;
+  size_t	len;
+  size_t	size;
+  char		*arena;
+
+  for (h = desc_hash_string(cp) & (DESC_HASH_SIZE - 1);
+       desc_hash[h];
+       h = (h + 1) & (DESC_HASH_SIZE - 1)) {
+    if (strcmp(desc_arena + desc_hash[h] - 1, cp) == 0) {
+      return desc_hash[h] - 1;
+    }
   }
-  strcpy(desc->description, cp);
 
-  fprintf(log_file, "New Desc: %c%d: %s\n",
-	  house2name(house), unit, cp);
-  fflush(log_file);
+  len = strlen(cp) + 1;
+  if (desc_arena_used + len > desc_arena_size) {
+    size = desc_arena_size ? desc_arena_size : DESC_ARENA_INIT;
+    while (desc_arena_used + len > size) {
+      size *= 2;
+    }
+    arena = realloc(desc_arena, size);
+    if (!arena) {
+      fprintf(log_file, "! Out of memory for descriptions\n");
+      exit(1);
+    }
+    desc_arena = arena;
+    desc_arena_size = size;
+  }
+
+  memcpy(desc_arena + desc_arena_used, cp, len);
+  desc_hash[h] = desc_arena_used + 1;
+  desc_arena_used += len;
+  desc_strings++;
 
-  return desc;
+  return desc_hash[h] - 1;
 }
 
 
 /*
- * Lookup a description given the house code and unit number
+ * Rebuild the arena with only the strings still in the table.
  */
-static x10_desc *
-find_desc (int house, int unit) {
-  x10_desc	*desc;
-
-  for (desc = desc_list ; desc ; desc = desc->next) {
-    if (desc->house == house && desc->unit == unit) {
-      return desc;
+static void
+desc_compact (void) {
+  char		*old;
+  int		house, unit;
+
+  old = desc_arena;
+  desc_arena = NULL;
+  desc_arena_size = 0;
+  desc_arena_used = 0;
+  bzero(desc_hash, sizeof(desc_hash));
+  desc_strings = 0;
+
+  for (house = 0; house <= 16; house++) {
+    for (unit = 0; unit <= 16; unit++) {
+      desc_default[house][unit] = desc_store(old + desc_default[house][unit]);
+      if (desc_set[house][unit]) {
+	desc_offset[house][unit] = desc_store(old + desc_offset[house][unit]);
+      } else {
+	desc_offset[house][unit] = desc_default[house][unit];
+      }
     }
   }
 
-  return NULL;
+  free(old);
 }
 
+
 /*
- * Remove a description from the linked list
+ * Intern a string, first throwing away any dead ones if we're
+ * about to run out of room.
  */
-static void
-remove_desc (x10_desc *desc) {
-  x10_desc	*d;
+static unsigned int
+desc_intern (char *cp) {
 
-  if (desc_list == desc) {	/* remove first one */
-    desc_list = desc_list->next;
-    free(desc);
-    return;
+  if (desc_strings >= DESC_HASH_SIZE * 3 / 4 ||
+      desc_arena_used + strlen(cp) + 1 > desc_arena_size) {
+    desc_compact();
   }
 
-  for (d = desc_list ; d->next ; d = d->next) {
-    if (d->next == desc) {
-      d->next = d->next->next;
-      free(desc);
-      return;
+  return desc_store(cp);
+}
+
+
+/*
+ * Fill the table with the generic names.
+ */
+static void
+init_descs (void) {
+  char		buffer[80];
+  int		house, unit;
+
+  for (house = 0; house <= 16; house++) {
+    for (unit = 0; unit <= 16; unit++) {
+      snprintf(buffer, sizeof(buffer)-1, "%c %2d",
+	       house2name(house), unit);
+      desc_default[house][unit] = desc_store(buffer);
+      desc_offset[house][unit] = desc_default[house][unit];
+      desc_set[house][unit] = FALSE;
     }
   }
-
-  return;
 }
 
+
 /*
- * Insert a new description for a house code and unit number into
- * the list.
+ * Remove a description, going back to the generic name.
  */
 static void
-insert_desc(int house, int unit, char *cp) {
-  x10_desc	*desc;
-  
-  desc = new_desc(house, unit, cp);
-  if (!desc)
-    return;
+remove_desc (int house, int unit) {
 
-  /*
-   * Insert into linked list
-   */
-  desc->next = desc_list;
-  desc_list = desc;
+  desc_set[house][unit] = FALSE;
+  desc_offset[house][unit] = desc_default[house][unit];
 }
 
+
 /*
- * Replace a description with a new one.
+ * Triggers or descriptions have changed - save them in a while.
  */
 static void
-replace_desc (x10_desc *desc, char *des) {
+config_changed (void) {
 
-  free(desc->description);
-  
-  if (strlen(des) > 0) {
-    desc->description = malloc(strlen(des)+1);
-    strcpy(desc->description, des);
-  } else {			/* remove it instead */
-    remove_desc(desc);
-  }
+  if (save_loading || !command_file)
+    return;
+  arm_timer(save_timer_fd, SAVE_DELAY, FALSE);
 }
 
+
 /*
- Add a new description to the linked list.
+ Add a new description to the table, or replace the one there.
+ An empty description removes it.
  */
 static void
 add_desc (int house, int unit, char *cp) {
-  x10_desc	*desc;
 
-  desc = find_desc(house, unit);
-  if (!desc) {
-    insert_desc(house, unit, cp);
-  } else {
-    replace_desc(desc, cp);
+  if (house < 0 || house > 16 || unit < 0 || unit > 16) {
+    fprintf(log_file, "! Bad description unit %c%d\n",
+	    house2name(house), unit);
+    return;
+  }
+
+  if (reload_staging) {
+    free(reload_descs[house][unit]);
+    reload_descs[house][unit] = (*cp) ? strdup(cp) : NULL;
+    return;
+  }
+
+  config_changed();
+  if (strlen(cp) == 0) {
+    remove_desc(house, unit);
+    return;
+  }
+
+  if (!desc_set[house][unit]) {
+    fprintf(log_file, "New Desc: %c%d: %s\n",
+	    house2name(house), unit, cp);
+    fflush(log_file);
   }
+
+  desc_offset[house][unit] = desc_intern(cp);
+  desc_set[house][unit] = TRUE;
 }
 
 
 /*
- * Print out all descriptions in the linked list using the same
+ * Print out all descriptions in the table using the same
  * style as would be expected as the input command.
  */
 static void
 print_descs (FILE *file) {
-  x10_desc	*desc;
-
-  for (desc = desc_list ; desc ; desc = desc->next) {
-    fprintf(file, "desc %c%2d %s\n",
-	    house2name(desc->house), desc->unit,
-	    desc->description);
+  int		house, unit;
+
+  for (house = 0; house <= 16; house++) {
+    for (unit = 0; unit <= 16; unit++) {
+      if (desc_set[house][unit]) {
+	fprintf(file, "desc %c%2d %s\n",
+		house2name(house), unit,
+		desc_arena + desc_offset[house][unit]);
+      }
+    }
   }
   fflush(file);
 }
 
 /*
- * Look for a description for this house code and unit number.
- * If we don't find one, create a generic one on-the-fly.
+ * Look up the description for this house code and unit number.
+ * Cells without one hold a generic name, so there's always something.
  */
 static char *
 x10_description (char house, int unit) {
-  static char	buffer[80];
-  x10_desc	*desc;
 
-  desc = find_desc(house, unit);
-  if (desc) {
-    return desc->description;
-  }
-
-  snprintf(buffer, sizeof(buffer)-1, "%c %2d",
-	   house2name(house), unit);
-  return buffer;
+  return desc_arena + desc_offset[(int)house][unit];
 }
 
 /*
- * Copy from "command" into "buffer", while handling special substitutions.
- * Don't use more than "bufsize" characters in the output.
- * Substitutions allowed are:
+ * Compile a command into a template.  Substitutions allowed are:
  * %h = house code
  * %u = unit number
  * %f = function code
  * %d = description string associated with house and unit 
+ * %t = time, in seconds since the epoch
+ * Any other character after a '%' is kept and the '%' dropped.
+ * Without "substitute", the whole command is one literal.
+ * The template points into "command", which has to stay around.
  */
-static void
-substitute_characters(char *buffer, int bufsize, char *command,
-		      int house, int unit, func_value func) {
-  char		*cp1, *cp2;
-  int		count;
+static x10_template *
+compile_template (char *command, boolean substitute) {
+  x10_template	*template;
+  template_op	*op;
+  char		*cp, *literal;
+  int		nops;
+
+  nops = 1;
+  for (cp = command; substitute && *cp; cp++) {
+    if (*cp == '%') {
+      nops += 2;
+    }
+  }
 
-  cp1 = buffer;
-  cp2 = command;
-  while ( *cp2 ) {
-    if (*cp2 != '%') {
-      *cp1++ = *cp2++;
-      bufsize--;
-    } else {
-      cp2++;
-      bufsize--;
-      if (*cp2 == 'h') {
-	cp2++;
-	*cp1++ = house2name(house);
-	bufsize--;
-      } else if (*cp2 == 'u') {
-	cp2++;
-	count = sprintf(cp1, "%d", unit);
-	cp1 += count;
-	bufsize -= count;
-      } else if (*cp2 == 'f') {
-	cp2++;
-	count = sprintf(cp1, "%s", func2name(func));
-	cp1 += count;
-	bufsize -= count;
-      } else if (*cp2 == 'd') {
-	cp2++;
-	count = sprintf(cp1, "%s", x10_description(house, unit));
-	cp1 += count;
-	bufsize -= count;
-      }
+  template = malloc(sizeof(*template) + nops * sizeof(template_op));
+  if (!template)
+    return NULL;
+
+  op = template->ops;
+  literal = command;
+  for (cp = command; substitute && *cp; cp++) {
+    if (*cp != '%')
+      continue;
+
+    if (cp > literal) {
+      op->op = TEMPLATE_LITERAL;
+      op->text = literal;
+      op->len = cp - literal;
+      op++;
+    }
+
+    switch (cp[1]) {
+    case 'h':
+      op->op = TEMPLATE_HOUSE;
+      break;
+    case 'u':
+      op->op = TEMPLATE_UNIT;
+      break;
+    case 'f':
+      op->op = TEMPLATE_FUNCTION;
+      break;
+    case 'd':
+      op->op = TEMPLATE_DESCRIPTION;
+      break;
+    case 't':
+      op->op = TEMPLATE_TIME;
+      break;
+    default:
+      literal = cp + 1;		/* just drop the '%' */
+      continue;
+    }
+    op++;
+    cp++;
+    literal = cp + 1;
+  }
+
+  cp = literal + strlen(literal);
+  if (cp > literal) {
+    op->op = TEMPLATE_LITERAL;
+    op->text = literal;
+    op->len = cp - literal;
+    op++;
+  }
+
+  template->nops = op - template->ops;
+  return template;
+}
+
+
+/*
+ * Expand a template into "buffer" for a house code, unit number and
+ * function, using no more than "bufsize" characters including the
+ * terminating NUL.  Returns the length, or -1 if it didn't all fit.
+ */
+static int
+expand_template (x10_template *template, char *buffer, int bufsize,
+		 int house, int unit, func_value func) {
+  template_op	*op;
+  char		number[24];
+  char		*cp, *end;
+  char		*text;
+  int		len;
+  boolean	truncated;
+
+  cp = buffer;
+  end = buffer + bufsize - 1;
+  truncated = FALSE;
+  for (op = template->ops; op < &template->ops[template->nops]; op++) {
+    switch (op->op) {
+    case TEMPLATE_LITERAL:
+      text = op->text;
+      len = op->len;
+      break;
+    case TEMPLATE_HOUSE:
+      number[0] = house2name(house);
+      text = number;
+      len = 1;
+      break;
+    case TEMPLATE_UNIT:
+      len = snprintf(number, sizeof(number), "%d", unit);
+      text = number;
+      break;
+    case TEMPLATE_FUNCTION:
+      text = func2name(func);
+      len = strlen(text);
+      break;
+    case TEMPLATE_DESCRIPTION:
+      text = x10_description(house, unit);
+      len = strlen(text);
+      break;
+    case TEMPLATE_TIME:
+      len = snprintf(number, sizeof(number), "%ld", (long)time(NULL));
+      text = number;
+      break;
+    default:
+      continue;
+    }
+
+    if (len > end - cp) {
+      len = end - cp;
+      truncated = TRUE;
     }
+    memcpy(cp, text, len);
+    cp += len;
   }
+  *cp = '\0';
 
-  *cp1 = '\0';
+  return truncated ? -1 : cp - buffer;
 }
 
 
@@ -619,1271 +1760,4640 @@ substitute_characters(char *buffer, int bufsize, char *command,
  ************************************************************************/
 
 /*
- * Search through our linked list of trigger structs looking for the
- * particular house code, unit number, and function passed.
+ * Return the triggers for a house code, unit number and function,
+ * indexed by "when".
  */
-static x10_trigger *
-find_trigger (int house, int unit, func_value function, when_t when) {
-  x10_trigger	*trigger;
-
-  for (trigger = trigger_list ; trigger ; trigger = trigger->next) {
-    if (trigger->house == house && trigger->unit == unit &&
-	when == NEVER && trigger->when == NEVER) {
-	/* found directive to "never" do this trigger */
-      return trigger;
-    } else if (trigger->house == house && trigger->unit == unit &&
-	       trigger->function == function &&
-	       (trigger->when == when || when == NONE)) {
-      /* found directive matching this trigger */
-      return trigger;
-    }
-  }
+static x10_trigger **
+trigger_slots (int house, int unit, func_value function) {
 
-  return NULL;
+  return trigger_index[house][unit][function];
 }
 
+
 /*
- * Remove a trigger from the linked list
+ * Look up the trigger for the particular house code, unit number,
+ * function and "when" passed.
+ * A "when" of NEVER finds any "never" for the house code and unit number.
+ * A "when" of NONE finds the newest trigger of any kind for the function.
  */
-static void
-remove_trigger (x10_trigger *trigger) {
-  x10_trigger	*t;
+static x10_trigger *
+find_trigger (int house, int unit, func_value function, when_t when) {
+  x10_trigger	**slots;
+  x10_trigger	*trigger;
+  int		w;
 
-      fprintf(log_file, "remove trigger %c%02d %-4s\n",
-	      house2name(trigger->house), trigger->unit,
-	      func2name(trigger->function));
+  if (house < 0 || house > 16 || unit < 0 || unit > 16)
+    return NULL;
 
-  if (trigger_list == trigger) {	/* remove first one */
-    trigger_list = trigger_list->next;
-fprintf(log_file, "removed first one\n");
-    free(trigger);
-    return;
+  if (when == NEVER) {
+    /* found directive to "never" do this trigger */
+    return never_index[house][unit];
   }
 
-  for (t = trigger_list ; t->next ; t = t->next) {
-    if (t->next == trigger) {
-      t->next = t->next->next;
-fprintf(log_file, "removed internal one\n");
-      free(trigger);
-      return;
+  slots = trigger_slots(house, unit, function);
+  if (when != NONE) {
+    return slots[when];
+  }
+
+  trigger = NULL;
+  for (w = TRANSITION; w < NUM_WHENS; w++) {
+    if (slots[w] && (!trigger || slots[w]->seq > trigger->seq)) {
+      trigger = slots[w];
     }
   }
 
-  return;
+  return trigger;
 }
 
 
 /*
- * Verify that the command read matches the next one we saved
+ * Put a trigger into the index
  */
-static boolean
-ti103_cmd_verify (char house, int unit, func_value func) {
+static void
+index_trigger (x10_trigger *trigger) {
 
-  if (tty == -1) {
-    printf("Trying to verify command %c%02d %s at idx=%d\n",
-	   house2name(house), unit, func2name(func), ti103_cmds_verify);
+  trigger_index[trigger->house][trigger->unit][trigger->function]
+    [trigger->when] = trigger;
+  if (trigger->when == NEVER) {
+    never_index[trigger->house][trigger->unit] = trigger;
   }
+}
 
-  /*
-   * If we have caught up with written commands,
-   * there's nothing to verify
-   */
-  if (ti103_cmds_verify == ti103_cmds_write) {
-    return FALSE;
-  }
 
-  if (ti103_cmds[ti103_cmds_verify].house == house &&
-      ti103_cmds[ti103_cmds_verify].unit == unit &&
-      ti103_cmds[ti103_cmds_verify].func == func) {
-    if (tty == -1) {
-      printf("Verified command %c%02d %s at idx=%d\n",
-	     house2name(house), unit, func2name(func), ti103_cmds_verify);
-    }
+/*
+ * Take a trigger out of the index.  If it was the "never" for its
+ * house/unit, fall back to the newest other one there is.
+ */
+static void
+unindex_trigger (x10_trigger *trigger) {
+  x10_trigger	*t;
+  x10_trigger	*never;
+  int		f;
+
+  trigger_index[trigger->house][trigger->unit][trigger->function]
+    [trigger->when] = NULL;
+
+  if (never_index[trigger->house][trigger->unit] != trigger)
+    return;
 
-    ti103_cmds_verify++;
-    if (ti103_cmds_verify >= MAX_OUTSTANDING_CMDS) {
-      ti103_cmds_verify = 0;	/* loop around */
+  never = NULL;
+  for (f = 0; f < NUM_FUNCTIONS; f++) {
+    t = trigger_index[trigger->house][trigger->unit][f][NEVER];
+    if (t && (!never || t->seq > never->seq)) {
+      never = t;
     }
-    return TRUE;
   }
-
-  return FALSE;
+  never_index[trigger->house][trigger->unit] = never;
 }
 
 
+/*
+ * Remove a trigger from the linked list
+ */
 static void
-event_log (int house, int unit, func_value function) {
-  time_t		t;
-  static int		last_house;
-  static int		last_unit;
-  static func_value	last_func;
+remove_trigger (x10_trigger *trigger) {
+  x10_trigger	*t;
 
-  if (!events_file || *events_file == '\0') {
+      fprintf(log_file, "remove trigger %c%02d %-4s\n",
+	      house2name(trigger->house), trigger->unit,
+	      func2name(trigger->function));
+
+  unindex_trigger(trigger);
+
+  if (trigger_list == trigger) {	/* remove first one */
+    trigger_list = trigger_list->next;
+    free(trigger);
     return;
   }
 
-  if (!events_fd) {
-    events_fd = fopen(events_file, "a");
-    if (!events_fd) {
-      fprintf(log_file, "Error opening events file '%s'\n",
-	      events_file);
+  for (t = trigger_list ; t->next ; t = t->next) {
+    if (t->next == trigger) {
+      t->next = t->next->next;
+      free(trigger);
       return;
     }
   }
 
-  if (house == last_house && unit == last_unit &&
-      function == last_func) {
+  return;
+}
+
+
+/*
+ * An ON or OFF for a device, sent or seen, replaces any ON or OFF the
+ * other way we're still waiting to see, so it's never sent again over
+ * the top of the newer one.
+ */
+static void
+ti103_cmd_supersede (char house, int unit, func_value func) {
+  func_value	opposite;
+
+  if (func == on) {
+    opposite = off;
+  } else if (func == off) {
+    opposite = on;
+  } else {
     return;
   }
 
-  /*
-   * Log the event with a timestamp
-   */
-  time(&t);
-  fprintf(events_fd, "Device %s (%c%0d) %s %s", 
-	  x10_description(house, unit), house2name(house), unit,
-	  func2name(function), ctime(&t));
-  fflush(events_fd);
-
-  last_house = house;
-  last_unit = unit;
-  last_func = function;
+  if (unit >= 1 && unit <= 16 && verify_sent[(int)house][unit][opposite]) {
+    verify_sent[(int)house][unit][opposite] = 0;
+    verify_outstanding--;
+  }
 }
 
 
-static boolean
-parse_ti103_output (void) {
-  char		*cptr, *cptr2, *endptr;
-  static int	house;
-  func_value	function;
-  state_value	old_state, new_state;
-  x10_desc	*desc;
-  x10_trigger	*trigger;
-  int		did_trigger=0;
-  
-  if (ti103_output_ptr == ti103_output) {
-    return FALSE;
-  }
+/*
+ * Check a command read off the wire against those we're waiting to
+ * see, and if it's one of them note how long it took.  Returns the
+ * priority it was sent with, or -1 if it isn't one of ours.
+ */
+static int
+ti103_cmd_verify (char house, int unit, func_value func) {
+  long		rtt;
 
-  /*
-   * See if we have a complete response first
-   */
-  for (cptr = ti103_output ; *cptr && *cptr != '#' ; cptr++) ;
-  if (*cptr != '#') {
-    /* Need to read more */
-    return FALSE;
-  } else {
-    cptr -= 2;
-    if (cptr < ti103_output) {
-      ti103_output_ptr = ti103_output;
-      return FALSE;
-    }
-    *cptr = '\0';
+  ti103_cmd_supersede(house, unit, func);
+
+  if (unit < 1 || unit > 16 || verify_sent[(int)house][unit][func] == 0) {
+    return -1;
   }
 
-  /*
-   * Skip over the intro bytes
-   */
-  cptr = ti103_output;
-  if (strncmp(cptr, TI103_REPLY_GOOD, sizeof(TI103_REPLY_GOOD)-1) == 0) {
-    cptr += sizeof(TI103_REPLY_GOOD)-1;
+  rtt = now_msecs() - verify_sent[(int)house][unit][func];
+  verify_sent[(int)house][unit][func] = 0;
+  verify_outstanding--;
+
+  verify_seen[(int)house][unit]++;
+  verify_rtt_total[(int)house][unit] += rtt;
+  if (rtt > verify_rtt_max[(int)house][unit]) {
+    verify_rtt_max[(int)house][unit] = rtt;
   }
 
-  if (strlen(cptr) > 0) {
-    fprintf(log_file, "Parsing Buffer '%s'\n", cptr);
+  if (tty == -1) {
+    printf("Verified command %c%02d %s in %ld msecs\n",
+	   house2name(house), unit, func2name(func), rtt);
   }
+  return verify_origin[(int)house][unit][func];
+}
 
-  ti103_read_waiting = FALSE;	/* no longer waiting for input */
 
-  /* Parse the string */
-  while ( *cptr  ) {
-    
-    /* Skip spaces */
-    if (*cptr == ' ') {
-      cptr++;
-      continue;
-    }
+/*
+ * Day of the year now, local time, for "daily" rotation.
+ */
+static int
+events_today (void) {
+  time_t	t;
+  struct tm	tm;
 
-    /* Found a house code */
-    if (*cptr >= 'A' && *cptr <= 'P') {
-      house = name2house(*cptr);	/* save house code */
-      /*      printf("House code = %c\n", *cptr); */
-      cptr++;
-    }
+  time(&t);
+  localtime_r(&t, &tm);
+  return tm.tm_yday;
+}
 
-    /* Found a digit or a function name */
-    if (isdigit(*cptr)) {
-      house_unit[house] = atoi(cptr);	/* save unit code */
-      /*      printf("Unit code = %i\n", house_unit[house]); */
-      while (isdigit(*cptr)) cptr++;
-    } else if ((function = parse_ti103_function(&new_state, &cptr))
-	       != no_function &&
-	       house_unit[house] != 0) {
-      fprintf(log_file, "Device %c %i %s\n", house2name(house),
-	      house_unit[house], func2name(function));
-      event_log(house, house_unit[house], function);
-      ti103_cmd_verify(house, house_unit[house], function);
-      if (function == hail_ack) {
-	  (void)function_trigger(house, house_unit[house], function, NONE);
-	  (void)all_trigger(house, house_unit[house], function);
-	  did_trigger = 1;
-      } else if ((new_state == state_on || new_state == state_off)) {
-	  trigger = find_trigger(house, house_unit[house], function, NONE);
-	  old_state = states[house][house_unit[house]];
-	  states[house][house_unit[house]] = new_state;
-	  if (old_state != new_state) {
-	      fprintf(log_file, "  (Device %c%d ",
-		      house2name(house), house_unit[house]);
-	      desc = find_desc(house, house_unit[house]);
-	      if (desc) {
-		  fprintf(log_file, "(%s) ", desc->description);
-	      }
-	      fprintf(log_file, "changed state from %s to %s)\n",
-		      state2name(old_state), state2name(new_state));
-	  }
-	  if ((trigger = find_trigger(house, house_unit[house], function, NEVER)) != NULL) {
-	    did_trigger = 1;	/* pretend we did it */
-	  } else if ((old_state != new_state) &&
-		(trigger = find_trigger(house, house_unit[house], function, TRANSITION))) {
-	    /* matching "trigger ..." */
-	      (void)perform_trigger(trigger, house, house_unit[house], function);
-	      did_trigger = 1;
-	  } else if ((trigger = find_trigger(house, house_unit[house], function, ALWAYS)) != NULL) {
-	    /* matching "always ..." */
-	      (void)perform_trigger(trigger, house, house_unit[house], function);
-	      did_trigger = 1;
-	  }
-	  if (!did_trigger) {
-	    /* else, matching "always ..." */
-	    (void)all_trigger(house, house_unit[house], function);
-	  }
-      }
-      house_unit[house] = 0;	/* read complete house/unit/command */
-      house = 0;
-      fflush(log_file);
-    } else {
-      /* skip over a nonsense character */
-      cptr++;
+
+static void
+events_open (void) {
+  struct stat	st;
+
+  events_fd = open(events_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		   0644);
+  if (events_fd == -1) {
+    if (!events_failed) {
+      fprintf(log_file, "! Error opening events file '%s' - errno=%d\n",
+	      events_file, errno);
+      events_failed = TRUE;
     }
+    return;
+  }
+
+  events_failed = FALSE;
+  events_size = 0;
+  if (fstat(events_fd, &st) == 0) {
+    events_size = st.st_size;
   }
+  events_day = events_today();
+}
 
-  /* update parsing to here */
-  memmove(ti103_output, cptr, ti103_output_ptr - cptr);
-  ti103_output_ptr = ti103_output;
 
-  fflush(log_file);
-  return TRUE;
+static void
+events_close (void) {
+
+  if (events_fd != -1) {
+    close(events_fd);
+    events_fd = -1;
+  }
 }
 
 
-static void ti103_cmd_print(void) {
-  int	i;
+/*
+ * Move the events file aside as "<file>.YYYYMMDD-HHMMSS" and start a
+ * new one.
+ */
+static void
+events_rotate (void) {
+  char		name[1024];
+  char		stamp[32];
+  time_t	t;
+  struct tm	tm;
 
-  /* caught up with verification - could be a problem */
-  fprintf(log_file,
-	  "*** ti103_cmds_write == %d\nti103_cmds_verify == %d ***\n",
-	  ti103_cmds_write, ti103_cmds_verify);
+  time(&t);
+  localtime_r(&t, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+  snprintf(name, sizeof(name), "%s.%s", events_file, stamp);
+
+  events_close();
+  if (rename(events_file, name) == -1) {
+    fprintf(log_file, "! Can't rotate events file to '%s' - errno=%d\n",
+	    name, errno);
+  } else {
+    fprintf(log_file, "Rotated events file to '%s'\n", name);
+    events_rotations++;
+  }
+  events_open();
+}
 
-  for(i=0; i<MAX_OUTSTANDING_CMDS; i++) {
-    fprintf(log_file, "** ti103_cmds[%d]='%c%02d %s'\n", i,
-	    house2name(ti103_cmds[i].house), ti103_cmds[i].unit,
-	    func2name(ti103_cmds[i].func));
+
+/*
+ * The file couldn't be opened or written; keep what's waiting and try
+ * again later.
+ */
+static void
+events_retry_later (void) {
+
+  if (events_retry == 0) {
+    events_retry = MIN_EVENTS_RETRY;
+  } else if (events_retry < MAX_EVENTS_RETRY) {
+    events_retry *= 2;
+    if (events_retry > MAX_EVENTS_RETRY) {
+      events_retry = MAX_EVENTS_RETRY;
+    }
   }
-  fflush(log_file);
-  /*  system("/usr/bin/mail -s 'X10 verified cmds error' raj@mischievous.us"); */
+  arm_timer(events_timer_fd, events_retry, FALSE);
 }
 
+
 /*
- * Save away TI103 commands which have been written to the device
- * so they can be verified later.
+ * Write out everything waiting, rotating the file first if it's due.
+ * If the file can't be written the events stay put for next time.
  */
 static void
-ti103_cmd_write (char house, int unit, func_value func) {
+events_write (void) {
+  size_t	chunk;
+  ssize_t	ret;
 
-  ti103_cmds[ti103_cmds_write].house = house;
-  ti103_cmds[ti103_cmds_write].unit = unit;
-  ti103_cmds[ti103_cmds_write].func = func;
+  if (events_len == 0 || !events_file)
+    return;
 
-  if (tty == -1) {
-    printf("Saving command %c%02d %s at idx=%d\n",
-	   house, unit, func2name(func), ti103_cmds_write);
+  if (events_fd == -1) {
+    events_open();
+    if (events_fd == -1) {
+      events_retry_later();
+      return;
+    }
   }
 
-  ti103_cmds_write++;
-  if (ti103_cmds_write == ti103_cmds_verify) {
-    ti103_cmd_print();
+  if ((events_daily && events_today() != events_day) ||
+      (events_rotate_size && events_size > 0 &&
+       events_size + (off_t)events_len > events_rotate_size)) {
+    events_rotate();
+    if (events_fd == -1) {
+      events_retry_later();
+      return;
+    }
   }
-  if (ti103_cmds_write >= MAX_OUTSTANDING_CMDS) {
-    ti103_cmds_write = 0;	/* loop around */
+
+  while (events_len > 0) {
+    chunk = events_len;
+    if (events_head + chunk > sizeof(events_buffer)) {
+      chunk = sizeof(events_buffer) - events_head;
+    }
+
+    ret = write(events_fd, &events_buffer[events_head], chunk);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf(log_file, "! Error writing events file - errno=%d\n", errno);
+      events_close();		/* try again from scratch next time */
+      events_retry_later();
+      return;
+    }
+
+    events_head = (events_head + ret) % sizeof(events_buffer);
+    events_len -= ret;
+    events_size += ret;
+    events_writes++;
   }
+
+  events_head = 0;
+  events_retry = 0;
+  arm_timer(events_timer_fd, 0, FALSE);
 }
 
 
 /*
- * TI103 checksum is the sum of all characters but only
- * using the two low order bytes
+ * SIGHUP - open the file again, in case it's been moved, and write
+ * out what we have to the new one.
  */
 static void
-write_ti103_checksum (char *prefix, char *command, int size) {
-  char	buffer[4];
-  char	*cp;
-  int	i;
+events_reopen (void) {
 
-  i = 0;
-  for (cp = prefix; *cp; cp++) {
-    i += *cp;
-  }
-  for (cp = command; cp < &command[size]; cp++) {
-    i += *cp;
-  }
+  if (!events_file)
+    return;
 
-  sprintf(buffer, "%2x#", i & 0xff);
-  fprintf(log_file, "Checksum=0x%2x\n", i & 0xFF);
-  write_ti103(buffer, 3);
+  fprintf(log_file, "Reopening events file '%s'\n", events_file);
+  events_close();
+  events_failed = FALSE;
+  events_open();
+  events_write();
 }
 
 
+/*
+ * Copy "src" into "dst" as the inside of a JSON string.
+ */
 static void
-write_ti103_command (char house, int unit, func_value func) {
-  char		command[80];
-  int		size;
-  
-  size = snprintf(command, sizeof(command),
-		  "%c%02d%c%02d %c%s%c%s",
-		  house2name(house),unit,
-		  house2name(house),unit,
-		  house2name(house), func2name(func),
-		  house2name(house), func2name(func));
+json_escape (char *dst, size_t size, const char *src) {
+  size_t	len;
+
+  len = 0;
+  for (; *src && len + 7 < size; src++) {
+    if (*src == '"' || *src == '\\') {
+      dst[len++] = '\\';
+      dst[len++] = *src;
+    } else if ((unsigned char)*src < ' ') {
+      len += sprintf(&dst[len], "\\u%04x", (unsigned char)*src);
+    } else {
+      dst[len++] = *src;
+    }
+  }
+  dst[len] = '\0';
+}
 
-  fprintf(log_file, "Writing command '%s'\n", command);
-  fflush(log_file);
 
-  write_ti103(TI103_COMMAND, sizeof(TI103_COMMAND)-1);
-  write_ti103(command, size);
-  write_ti103_checksum(TI103_COMMAND, command, size);
-/*  write_ti103(TI103_CKSUM, sizeof(TI103_CKSUM)-1); */
+static void
+event_log (int house, int unit, func_value function) {
+  char			line[512];
+  char			desc[256];
+  struct timespec	ts;
+  size_t		len, tail, first;
+  int			ret;
+  static int		last_house;
+  static int		last_unit;
+  static func_value	last_func;
+  static time_t		stamp_time;
+  static char		stamp[32];
+
+  if (!events_file || *events_file == '\0') {
+    return;
+  }
+
+  if (house == last_house && unit == last_unit &&
+      function == last_func) {
+    return;
+  }
+  last_house = house;
+  last_unit = unit;
+  last_func = function;
 
   /*
-   * Store this away as our last command written
+   * Format the event with a timestamp
    */
-  ti103_cmd_write(house, unit, func);
-
-  if (tty == -1) {
-    strcpy(ti103_output, TI103_REPLY_GOOD);
-    strcat(ti103_output, command);
-    strcat(ti103_output, TI103_CKSUM);
-    ti103_output_ptr = &ti103_output[strlen(ti103_output)];
-    parse_ti103_output();
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (events_json) {
+    json_escape(desc, sizeof(desc), x10_description(house, unit));
+    ret = snprintf(line, sizeof(line),
+		   "{\"time\":%lld,\"house\":\"%c\",\"unit\":%d,"
+		   "\"function\":\"%s\",\"description\":\"%s\"}\n",
+		   (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+		   house2name(house), unit, func2name(function), desc);
+  } else {
+    if (ts.tv_sec != stamp_time) {
+      stamp_time = ts.tv_sec;
+      ctime_r(&stamp_time, stamp);
+    }
+    ret = snprintf(line, sizeof(line), "Device %s (%c%0d) %s %s",
+		   x10_description(house, unit), house2name(house), unit,
+		   func2name(function), stamp);
+  }
+  len = ret;
+  if (ret < 0 || len >= sizeof(line)) {
+    len = strlen(line);
   }
-}
 
+  if (events_len + len > sizeof(events_buffer)) {
+    events_dropped++;		/* the file's been unwritable a while */
+    return;
+  }
 
+  if (events_len == 0) {
+    arm_timer(events_timer_fd, events_flush, FALSE);
+  }
+  tail = (events_head + events_len) % sizeof(events_buffer);
+  first = sizeof(events_buffer) - tail;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(&events_buffer[tail], line, first);
+  memcpy(events_buffer, &line[first], len - first);
+  events_len += len;
+  events_logged++;
 
-func_value
-state2func(state_value state) 
-{
-    switch ( state ) {
-    case state_on:
-	return on;
-    case state_off:
-	return off;
-    default:
-	return no_function;
-    }
+  if (events_len >= sizeof(events_buffer) / 2 && events_retry == 0) {
+    events_write();
+  }
 }
-		
 
 
-/* Set this to say we received additional resets while doing resets */
-boolean reset_x10_again=FALSE;
+static int64_t
+epoch_msecs (void) {
+  struct timespec	ts;
 
-/*
- * Perform a full reset of all devices which are "on" or "off" as long
- * as they're not the house_code and unit_code of the reset trigger itself.
- */
-void
-reset_x10 (int reset_house, int reset_unit) 
-{
-    static time_t	last_reset=0;
-    static boolean	resetting=FALSE;
-    time_t		t;
-    int			house;
-    int			unit;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (resetting) {
-	reset_x10_again=TRUE;		/* do another one */
-	return;				/* already running */
-    }
-    resetting = TRUE;			/* lock out others */
 
-    fprintf(log_file, "Resetting all X10 devices to known state\n");
-    for (house = name2house('A'); house <= name2house('P'); house++) {
-	for (unit = 1; unit <= 16; unit++) {
-	    if ((states[house][unit] == state_on ||
-		 states[house][unit] == state_off) &&
-		!(house == reset_house && unit == reset_unit)) {
-		fprintf(log_file, "Resetting %c%d to %s\n",
-			house2name(house), unit,
-			state2name(states[house][unit]));
-		write_ti103_command(house, unit,
-				    state2func(states[house][unit]));
-	    }
-	}
-    }
+static boolean
+history_read (uint32_t n, history_record *rec, uint32_t count) {
+  ssize_t	want, ret;
 
-    resetting = FALSE;
+  want = (ssize_t)count * sizeof(*rec);
+  ret = pread(history_fd, rec, want, (off_t)n * sizeof(*rec));
+  return (ret == want);
 }
 
 
+static void
+history_add_index (uint32_t n, int64_t msecs) {
+  uint32_t	slot;
+
+  slot = n / HISTORY_INDEX_STRIDE;
+  if (slot >= history_index_size) {
+    history_index_size = history_index_size ? history_index_size * 2 : 1024;
+    history_index = realloc(history_index,
+			    history_index_size * sizeof(*history_index));
+  }
+  history_index[slot] = msecs;
+}
 
 
-void
-perform_trigger (x10_trigger *trigger, int house, int unit, func_value func) {
-  char		buffer[256];
+static uint32_t
+history_heads_check (history_heads *heads) {
+  uint32_t	check;
+  int		h, u;
 
-  /*
-   * If the command is a zero length string, then it's a reset-all
-   */
-  if (trigger->command == NULL) {
-      fprintf(log_file, "Requesting reset\n");
-      reset_x10(house, unit);
-      if (reset_x10_again) {
-	  reset_x10_again = FALSE;
-	  reset_x10(house, unit);
-      }
-      reset_x10_again = FALSE;
+  check = heads->count ^ 0xa5a5a5a5U;
+  for (h = 0; h <= 16; h++) {
+    for (u = 0; u <= 16; u++) {
+      check = (check << 1 | check >> 31) ^ heads->last[h][u];
+    }
+  }
+  return check;
+}
 
-      fflush(log_file);
-      return;
+
+static void
+history_save_heads (void) {
+  history_heads	heads;
+
+  if (history_heads_fd == -1)
+    return;
+
+  heads.count = history_count;
+  memcpy(heads.last, history_last, sizeof(heads.last));
+  heads.check = history_heads_check(&heads);
+  if (pwrite(history_heads_fd, &heads, sizeof(heads), 0) != sizeof(heads)) {
+    fprintf(log_file, "! Error writing history heads - errno=%d\n", errno);
   }
-  
-  /*
-   * Perform the command
-   */
-  fprintf(log_file, "%s: %c%d%s> %s\n",
-	  (trigger->when == TRANSITION) ? "Trigger" : "Always",
-	  house2name(house), unit, func2name(func),
-	  trigger->command);
-  strcpy(buffer, trigger->command);
-  strcat(buffer, " </dev/null >/dev/null");
-  fprintf(log_file, "returns %d\n", system(buffer));
 }
 
+
 /*
- * Perform the function associated with the house code and unit number.
+ * Saved heads are only any use if they're whole and for no more
+ * records than the store has.
  */
 static boolean
-function_trigger (int house, int unit, func_value func, when_t when) {
-  x10_trigger	*trigger;
-  char		*cmd;
+history_load_heads (history_heads *heads) {
+  int		h, u;
 
-  trigger = find_trigger(house, unit, func, when);
-  if (!trigger)
+  if (pread(history_heads_fd, heads, sizeof(*heads), 0) != sizeof(*heads) ||
+      heads->check != history_heads_check(heads) ||
+      heads->count > history_count)
     return FALSE;
 
-  perform_trigger(trigger, house, unit, func);
-
+  for (h = 0; h <= 16; h++) {
+    for (u = 0; u <= 16; u++) {
+      if (heads->last[h][u] != HISTORY_NONE &&
+	  heads->last[h][u] >= heads->count)
+	return FALSE;
+    }
+  }
   return TRUE;
 }
 
 
 static void
-all_trigger (int house, int unit, func_value func) {
-  x10_trigger	*trigger;
-  char		*cmd;
-  static char	buffer[256];
-
-  trigger = find_trigger(0, 0, no_function, NONE);
-  if (!trigger)
-    return;
-
-  substitute_characters(buffer, sizeof(buffer), trigger->command,
-			house, unit, func);
+history_close (void) {
 
-  fprintf(log_file, "Trigger: %c%d%s> %s\n",
-	  house2name(house), unit, func2name(func),
-	  buffer);
-  // strcpy(buffer, buffer);
-  strcat(buffer, " </dev/null >/dev/null");
-  fprintf(log_file, "returns %d\n", system(buffer));
+  if (history_fd != -1) {
+    history_save_heads();
+    close(history_fd);
+    history_fd = -1;
+  }
+  if (history_heads_fd != -1) {
+    close(history_heads_fd);
+    history_heads_fd = -1;
+  }
+  history_count = 0;
 }
 
 
-static char *
-skip_spaces (char *cp) {
+/*
+ * Open the store and rebuild the index and the device chain heads.
+ * The index is one read per HISTORY_INDEX_STRIDE records.  The heads
+ * come from the ".heads" file, brought up to date from the records
+ * added since it was written; without one the whole store is read,
+ * once, and the heads saved.
+ */
+static void
+history_open (void) {
+  struct stat		st;
+  history_record	*recs;
+  history_record	rec;
+  history_heads		heads;
+  char			path[1024];
+  uint32_t		n, count, i;
+
+  history_close();
+  memset(history_last, 0xff, sizeof(history_last));
+  history_fd = open(history_file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+		    0644);
+  if (history_fd == -1) {
+    fprintf(log_file, "! Error opening history file '%s' - errno=%d\n",
+	    history_file, errno);
+    return;
+  }
+  snprintf(path, sizeof(path), "%s.heads", history_file);
+  history_heads_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (history_heads_fd == -1) {
+    fprintf(log_file, "! Error opening '%s' - errno=%d\n", path, errno);
+  }
 
-  while (*cp && isspace(*cp)) cp++;
+  if (fstat(history_fd, &st) == 0) {
+    history_count = st.st_size / sizeof(history_record);
+    if (st.st_size % sizeof(history_record)) {
+      fprintf(log_file, "History file '%s' ends with a partial record\n",
+	      history_file);
+      (void)ftruncate(history_fd,
+		      (off_t)history_count * sizeof(history_record));
+    }
+  }
 
-  return cp;
-}
+  for (n = 0; n < history_count; n += HISTORY_INDEX_STRIDE) {
+    if (!history_read(n, &rec, 1))
+      break;
+    history_add_index(n, rec.msecs);
+  }
 
+  n = 0;
+  if (history_heads_fd != -1 && history_load_heads(&heads)) {
+    memcpy(history_last, heads.last, sizeof(history_last));
+    n = heads.count;
+  }
+  recs = malloc(HISTORY_SCAN * sizeof(*recs));
+  for ( ; n < history_count && recs; n += count) {
+    count = history_count - n;
+    if (count > HISTORY_SCAN) {
+      count = HISTORY_SCAN;
+    }
+    if (!history_read(n, recs, count))
+      break;
+    for (i = 0; i < count; i++) {
+      if (recs[i].house >= 1 && recs[i].house <= 16 &&
+	  recs[i].unit >= 1 && recs[i].unit <= 16) {
+	history_last[recs[i].house][recs[i].unit] = n + i;
+      }
+    }
+  }
+  free(recs);
+  if (n >= history_count) {
+    history_save_heads();
+  }
 
-static char *
-skip_until_space (char *cp) {
+  fprintf(log_file, "History file '%s' has %u records\n",
+	  history_file, history_count);
+}
 
-  while (*cp && !isspace(*cp)) cp++;
 
-  return cp;
-}
+static void
+history_append (int house, int unit, func_value function, int origin) {
+  history_record	rec;
 
+  if (history_fd == -1)
+    return;
 
-static char *
-skip_digits (char *cp) {
+  bzero(&rec, sizeof(rec));
+  rec.msecs = epoch_msecs();
+  rec.prev = history_last[house][unit];
+  rec.house = house;
+  rec.unit = unit;
+  rec.function = function;
+  rec.origin = origin;
 
-  while (*cp && isdigit(*cp)) cp++;
+  if (write(history_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+    fprintf(log_file, "! Error writing history file - errno=%d\n", errno);
+    return;
+  }
 
-  return cp;
+  if (history_count % HISTORY_INDEX_STRIDE == 0) {
+    history_add_index(history_count, rec.msecs);
+  }
+  history_last[house][unit] = history_count;
+  history_count++;
+  if (history_count % HISTORY_INDEX_STRIDE == 0) {
+    history_save_heads();
+  }
 }
 
 
 /*
- * Parse a house and unit code
- * Side-effects:
- *	sets *ahouse to the house code number
- *	sets *aunit to the unit number
- *	updates *cptr to pointer after parsed items
- * Considerations:
- *	takes either upper or lower case
- * Returns TRUE only if both are parsed correctly
+ * First record at or after "msecs".
  */
-static boolean
-parse_house_unit (char **cptr, char *ahouse, int *aunit) {
-  char	house;
-  int	unit;
-  char 	*cp;
-  
-  cp = *cptr;
-  if ((*cp >= 'A' && *cp <= 'P') ||
-      (*cp >= 'a' && *cp <= 'p')) {
-    house = name2house(*cp);
-    cp++;
-
-    cp = skip_spaces(cp);
-    if (isdigit(*cp)) {
-      unit = atoi(cp);
-      while (isdigit(*cp)) cp++;
-
-      *ahouse = house;
-      *aunit = unit;
-      *cptr = cp;		/* update our pointer */
-      return TRUE;		/* got both */
+static uint32_t
+history_find (int64_t msecs) {
+  history_record	*recs;
+  uint32_t		lo, hi, mid, start, count, i;
+
+  if (history_count == 0)
+    return 0;
+
+  /* Last index entry before msecs */
+  lo = 0;
+  hi = (history_count - 1) / HISTORY_INDEX_STRIDE + 1;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (history_index[mid] < msecs) {
+      lo = mid;
+    } else {
+      hi = mid;
     }
-
-    return FALSE;		/* incomplete */
   }
 
-  return FALSE;			/* incomplete */
-}
-
-
-void
-print_ti103_buffer(void) {
-  time_t	t;
-
-  if (ti103_output_ptr == ti103_output) {
-    return;
+  start = lo * HISTORY_INDEX_STRIDE;
+  count = history_count - start;
+  if (count > 2 * HISTORY_INDEX_STRIDE) {
+    count = 2 * HISTORY_INDEX_STRIDE;
   }
-
-  if (strcmp(ti103_output, "4B#") == 0)
-    return;
-
-  time(&t);
-
-  if (strcmp(ti103_output, TI103_REPLY_NULL) != 0) {
-    fprintf(log_file, "%s: %s", ti103_output, ctime(&t));
-    fflush(log_file);
+  recs = malloc(count * sizeof(*recs));
+  if (!recs || !history_read(start, recs, count)) {
+    free(recs);
+    return start;
   }
+  for (i = 0; i < count && recs[i].msecs < msecs; i++)
+    ;
+  free(recs);
+  return start + i;
 }
 
 
-void
-reset_ti103_buffer(void) {
+static uint8_t
+journal_check (journal_record *rec) {
 
-  ti103_output_ptr = ti103_output;
+  return (rec->secs ^ (rec->secs >> 8) ^ (rec->secs >> 16) ^
+	  (rec->secs >> 24) ^ rec->house ^ rec->unit ^ rec->state ^ 0xa5)
+	 & 0xff;
 }
 
-  
+
 /*
- * Read a result from the TI103
+ * Replace the journal with a snapshot of the current states: write a
+ * new file, make sure it's on disk, then rename it over the old one.
  */
-void
-read_ti103(boolean block) {
-  char	buffer[128];
-  int	ret;
-  char	*cptr, *start;
-  boolean	found_end, found_start;
-
-  found_end = FALSE;
-  found_start = FALSE;
-
-  while (!found_end) {
-    ret = read(tty, buffer, sizeof(buffer));
-    if (ret == -1 && !found_start && !block) {
-      return;
-    } else if (ret == -1) {
-      sleep(1);
-      continue;
-    }
-    buffer[ret] = '\0';
-    if (strcmp(buffer, TI103_REPLY_NULL) != 0) {
-      fprintf(log_file, "Read TI103: (%d bytes)'%s'\n", ret, buffer);
-    }
-    
-    /*
-     * Append this to our TI103 output buffer
-     */
-    for (cptr = buffer ; *cptr ; cptr++) {
-      if (strcmp(cptr, "$<") == 0) {
-	found_start = TRUE;
-      }
-
-      if (ti103_output_ptr >= &ti103_output[sizeof(ti103_output)]) {
-	fprintf(log_file, "! Ran out of TI103 buffer space\n");
-	return;
-      }
-      *ti103_output_ptr++ = *cptr;
-      *ti103_output_ptr = '\0';
-      if (*cptr == '#') {
-	found_end = TRUE;
-	print_ti103_buffer();
-	parse_ti103_output();
-	
-	/* Re-init to start a new command */
-	found_start = FALSE;
-	found_end = FALSE;
+static void
+journal_compact (void) {
+  char			temp[1024];
+  journal_record	recs[16 * 16];
+  int			h, u, n, fd;
+
+  n = 0;
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      if (states[h][u] != undefined) {
+	recs[n].secs = journal_time[h][u];
+	recs[n].house = h;
+	recs[n].unit = u;
+	recs[n].state = states[h][u];
+	recs[n].check = journal_check(&recs[n]);
+	n++;
       }
     }
   }
 
-  /*
-   * Since we have a complete command output, parse it
-   */
-  print_ti103_buffer();
-  parse_ti103_output();
+  snprintf(temp, sizeof(temp), "%s.tmp", journal_file);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(log_file, "! Error creating '%s' - errno=%d\n", temp, errno);
+    return;
+  }
+  if (write(fd, recs, n * sizeof(recs[0])) != (ssize_t)(n * sizeof(recs[0])) ||
+      fsync(fd) == -1) {
+    fprintf(log_file, "! Error writing '%s' - errno=%d\n", temp, errno);
+    close(fd);
+    unlink(temp);
+    return;
+  }
+  close(fd);
+
+  if (rename(temp, journal_file) == -1) {
+    fprintf(log_file, "! Error renaming '%s' - errno=%d\n", temp, errno);
+    unlink(temp);
+    return;
+  }
+
+  if (journal_fd != -1) {
+    close(journal_fd);
+  }
+  journal_fd = open(journal_file, O_WRONLY | O_APPEND | O_CLOEXEC);
+  journal_appended = 0;
+  journal_snapshots++;
 }
 
 
 static void
-get_ti103_status (int sig) {
+journal_state (int house, int unit, state_value state) {
+  journal_record	rec;
 
-  if (tty == -1)
+  journal_time[house][unit] = time(NULL);
+  if (journal_fd == -1)
     return;
 
-  if (verbose)
-    fprintf(log_file, "Reading status\n");
-  write_ti103(TI103_READ_BUFFER, sizeof(TI103_READ_BUFFER)-1);
-}
-
-
-static fd_set *
-check_input (void) {
-  static fd_set		readfds, zerofds;
-  int rfds;
-  int			nfds;
-  int			ret;
-  struct timeval	timeout;
-  int			temp_tty;
-
-  FD_ZERO(&readfds);
-  FD_ZERO(&zerofds);
-  FD_SET(STDIN_FILENO, &readfds);
-  if (tty != -1) {
-    FD_SET(tty, &readfds);
-    nfds = tty + 1;		/* number fd bits set */
-  } else {
-    nfds = 2 + 1;		/* stderr + 1 */
-  }
-  
-  /*
-   * Enter select - will be interrupted by:
-   * 1) new input from stdin
-   * 2) new input from ti103
-   * 3) the alarm which is set
-   */
-  bzero(&timeout, sizeof(timeout));
-  timeout.tv_sec = 2;
-  ret = select(nfds, &readfds, NULL, NULL, &timeout);
-  /*  printf("ret=%d\n", ret); */
-  if (ret <= 0) {
-    /* Probably our alarm */
-    return &zerofds;
+  rec.secs = journal_time[house][unit];
+  rec.house = house;
+  rec.unit = unit;
+  rec.state = state;
+  rec.check = journal_check(&rec);
+  if (write(journal_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+    fprintf(log_file, "! Error writing journal - errno=%d\n", errno);
+    return;
   }
 
-  return &readfds;
+  if (++journal_appended >= JOURNAL_COMPACT) {
+    journal_compact();
+  }
 }
 
 
+/*
+ * Replay the journal into states[][] - for devices we haven't heard
+ * from since starting - then start it again from a snapshot.  A torn
+ * or damaged record at the end is where a crash stopped us, so the
+ * replay stops there.
+ */
 static void
-print_status (FILE *fd,
-	      char *output_file,
-	      boolean desc) {
-  int		i, j;
-  FILE		*file;
-  boolean	got_file;
-  
-  got_file = FALSE;
-  if (fd) {			/* use output FD first */
-    file = fd;
-  } else if (output_file && *output_file) { /* filename 2nd */
-    file = fopen(output_file, "a");
-    if (file) {
-      got_file = TRUE;
-    }
+journal_open (void) {
+  journal_record	rec;
+  FILE			*file;
+  long			start, age;
+  time_t		now;
+  unsigned long		records, restored;
+  boolean		known[17][17];
+  int			h, u;
+
+  if (journal_fd != -1) {
+    close(journal_fd);
+    journal_fd = -1;
   }
 
-  if (!file) {			/* of log_file last */
-    file = log_file;
+  start = now_msecs();
+  now = time(NULL);
+  records = 0;
+  restored = 0;
+  bzero(known, sizeof(known));
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      known[h][u] = (states[h][u] != undefined);
+    }
   }
 
-  for (i = 1 ; i <= 16 ; i++) {
-    for (j = 1 ; j <= 16 ; j++) {
-      if (states[i][j] != undefined) {
-	if (desc) {
-	  fprintf(file, "%s %-4s\n",
-		  x10_description(i, j),
-		  state2name(states[i][j]));
-	} else {
-	  fprintf(file, "%c %d %-4s\n",
-		  house2name(i), j,
-		  state2name(states[i][j]));
-	}
+  file = fopen(journal_file, "r");
+  if (file) {
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+      if (rec.check != journal_check(&rec) ||
+	  rec.house < 1 || rec.house > 16 || rec.unit < 1 || rec.unit > 16) {
+	fprintf(log_file, "! Journal damaged after %lu records\n", records);
+	break;
+      }
+      records++;
+      if (known[rec.house][rec.unit])
+	continue;
+
+      states[rec.house][rec.unit] = rec.state;
+      journal_time[rec.house][rec.unit] = rec.secs;
+      if (rec.state == state_on || rec.state == state_off) {
+	age = (now > (time_t)rec.secs) ? (now - rec.secs) * 1000L : 0;
+	state_seen[rec.house][rec.unit] = (start > age) ? start - age : 1;
+      } else {
+	state_seen[rec.house][rec.unit] = 0;
       }
     }
+    fclose(file);
   }
-  fflush(file);
 
-  if (got_file) {
-    fclose(file);
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      if (!known[h][u] && states[h][u] != undefined) {
+	restored++;
+      }
+    }
   }
+
+  journal_compact();
+  fprintf(log_file, "Journal '%s': %lu records, %lu devices restored in %ld msecs\n",
+	  journal_file, records, restored, now_msecs() - start);
 }
 
 
-static x10_trigger *
-new_trigger (int house, int unit, func_value func, char *cp) {
-  x10_trigger	*trigger;
+/*
+ * A function has been seen on the wire for a unit: note its new
+ * state, log it, check it off against what we sent and run whatever
+ * it triggers.
+ *
+ * If it's our own command coming back, "remote" rules are left out,
+ * and if it was part of a reset sweep nothing is run at all; a sweep
+ * only puts back states we already knew about, and letting it fire
+ * rules (a reset rule, say) can start a loop.
+ */
+static void
+apply_x10_function (int house, int unit,
+		    func_value function, state_value new_state) {
+  state_value	old_state;
+  x10_trigger	**slots;
+  int		did_trigger=0;
+  int		origin;
+  boolean	local;
+  long		now, window;
+
+  fprintf(log_file, "Device %c %i %s\n", house2name(house),
+	  unit, func2name(function));
+  origin = ti103_cmd_verify(house, unit, function);
+  local = (origin >= 0);
+
+  now = now_msecs();
+  window = debounce_msecs[house][unit] ? debounce_msecs[house][unit]
+				      : debounce_default;
+  if (window > 0 && debounce_func[house][unit] == function &&
+      now - debounce_last[house][unit] < window) {
+      fprintf(log_file, "  (repeat, ignored)\n");
+      debounce_last[house][unit] = now;
+      debounced[house][unit]++;
+      if (new_state == state_on || new_state == state_off) {
+	  state_seen[house][unit] = now;
+      }
+      return;
+  }
+  debounce_last[house][unit] = now;
+  debounce_func[house][unit] = function;
 
-  trigger = malloc(sizeof(*trigger));
-  if (!trigger)
-    return NULL;
+  event_log(house, unit, function);
+  history_append(house, unit, function, origin + 1);
+  if (origin == PRI_SWEEP) {
+      did_trigger = 1;		/* pretend we did it */
+  }
 
-  trigger->house = house;
-  trigger->unit = unit;
-  trigger->function = func;
-  trigger->command = NULL;
-  if (cp) {
-      trigger->command = malloc(strlen(cp)+1);
-      if (!trigger->command) {
-	  free(trigger);
-	  return NULL;
+  if (function == hail_ack) {
+      if (!did_trigger) {
+	  (void)function_trigger(house, unit, function, NONE, local);
+	  (void)all_trigger(house, unit, function, local);
+      }
+      did_trigger = 1;
+  } else if ((new_state == state_on || new_state == state_off)) {
+      slots = trigger_slots(house, unit, function);
+      old_state = states[house][unit];
+      states[house][unit] = new_state;
+      state_seen[house][unit] = now;
+      if (old_state != new_state) {
+	  journal_state(house, unit, new_state);
+	  fprintf(log_file, "  (Device %c%d ",
+		  house2name(house), unit);
+	  if (desc_set[house][unit]) {
+	      fprintf(log_file, "(%s) ",
+		      x10_description(house, unit));
+	  }
+	  fprintf(log_file, "changed state from %s to %s)\n",
+		  state2name(old_state), state2name(new_state));
+      }
+      if (did_trigger) {
+	/* reset sweep */
+      } else if (never_index[house][unit] != NULL) {
+	did_trigger = 1;	/* pretend we did it */
+      } else if ((old_state != new_state) && slots[TRANSITION]) {
+	/* matching "trigger ..." */
+	  if (!(local && slots[TRANSITION]->opts.remote))
+	    (void)perform_trigger(slots[TRANSITION], house, unit, function);
+	  did_trigger = 1;
+      } else if (slots[ALWAYS] != NULL) {
+	/* matching "always ..." */
+	  if (!(local && slots[ALWAYS]->opts.remote))
+	    (void)perform_trigger(slots[ALWAYS], house, unit, function);
+	  did_trigger = 1;
+      }
+      if (!did_trigger) {
+	/* else, matching "always ..." */
+	(void)all_trigger(house, unit, function, local);
       }
-      strcpy(trigger->command, cp);
   }
-
-  return trigger;
 }
 
 
+/*
+ * Decode the body of a reply - everything between the "$<2800!" and
+ * the checksum.
+ *
+ * As on the powerline, addresses build up for each house code until a
+ * function comes along, and the function goes to every unit addressed
+ * ("A1 A2 A3 AON" turns on all three).  Each house code keeps its
+ * own list, so "A01B02 AON" turns on A1 and leaves B2 waiting for a B
+ * function.  A function uses up the addresses, so the repeat in our own
+ * "A01A01 AONAON" does nothing, and whatever's left when the frame
+ * ends is dropped rather than picked up by the next one.
+ */
 static void
-insert_trigger(int house, int unit, func_value func, when_t when, char * cp) {
-  x10_trigger	*trigger;
-  
-  trigger = new_trigger(house, unit, func, cp);
-  if (!trigger)
-    return;
-
-  /*
-   * Insert into linked list
-   */
-  trigger->next = trigger_list;
-  trigger_list = trigger;
-  trigger->when = when;
-}
+parse_ti103_frame (char *cptr, int len) {
+  int		house;
+  char		*end;
+  func_value	function;
+  state_value	new_state;
+  int		unit;
+  time_t	t;
 
+  if (*cptr) {
+    time(&t);
+    fprintf(log_file, "%s%s: %s", TI103_REPLY_GOOD, cptr, ctime(&t));
+    fprintf(log_file, "Parsing Buffer '%s'\n", cptr);
+  }
 
-static void
-replace_trigger (x10_trigger *trigger, char *cmd) {
+  if (ti103_read_waiting && *cptr) {
+    poll_frames++;		/* the poll found something */
+    poll_activity();
+  }
+  ti103_read_waiting = FALSE;	/* no longer waiting for input */
 
-    if (trigger->command) {
-	free(trigger->command);
-    }
+  /* Parse the string */
+  bzero(house_units, sizeof(house_units));
+  house = 0;
+  end = cptr + len;
+  while (cptr < end && *cptr) {
     
-    if (cmd && (strlen(cmd) > 0)) {
-	trigger->command = malloc(strlen(cmd)+1);
-	strcpy(trigger->command, cmd);
-    } else {			/* remove it instead */
-	remove_trigger(trigger);
+    /* Skip spaces */
+    if (*cptr == ' ') {
+      cptr++;
+      continue;
     }
-}
 
+    /* Found a house code */
+    if (*cptr >= 'A' && *cptr <= 'P') {
+      house = name2house(*cptr);	/* save house code */
+      cptr++;
+    }
 
-static void
-add_trigger(int house, int unit, func_value func, when_t when, char * cp) {
-  x10_trigger	*trigger;
-
-  trigger = find_trigger(house, unit, func, when);
-  if (!trigger) {
-    fprintf(log_file, "New ");
-    insert_trigger(house, unit, func, when, cp);
-  } else {
-    fprintf(log_file, "Replace ");
-    replace_trigger(trigger, cp);
-  }
-  if (house == 0) {
-    fprintf(log_file, "Trigger all: %s\n", cp);
-  } else {
-    fprintf(log_file, "Trigger: %c%d%s: %s\n",
-	    house2name(house), unit, func2name(func), cp);
+    /* Found a digit or a function name */
+    if (isdigit(*cptr)) {
+      unit = atoi(cptr);	/* add unit to those addressed */
+      if (unit >= 1 && unit <= 16) {
+	house_units[house] |= 1 << unit;
+      }
+      while (isdigit(*cptr)) cptr++;
+    } else if ((function = parse_ti103_function(&new_state, &cptr))
+	       != no_function) {
+      for (unit = 1; unit <= 16; unit++) {
+	if (house_units[house] & (1 << unit)) {
+	  apply_x10_function(house, unit, function, new_state);
+	}
+      }
+      house_units[house] = 0;	/* read complete house/unit/command */
+      house = 0;
+      fflush(log_file);
+    } else {
+      /* skip over a nonsense character */
+      cptr++;
+    }
   }
+
   fflush(log_file);
+}
 
+
+/*
+ * Value of a hex digit, or -1.
+ */
+static int
+hex_value (char c) {
+
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
 }
 
 
+/*
+ * Feed bytes from the TI103 to the reply parser.  A '$' always starts
+ * a new reply, whatever we were in the middle of, so we get back in
+ * step after line noise or a reply we only saw the end of.
+ */
 static void
-print_triggers (FILE *file) {
-  x10_trigger	*trigger;
+ti103_rx (char *data, int len) {
+  char		*cp;
+  char		c;
+  int		hi, lo;
 
-  for (trigger = trigger_list ; trigger ; trigger = trigger->next) {
-    //    if (trigger->function == no_function) {
-    if (trigger->house == 0 && trigger->unit == 0) {
-      if (trigger->when == ALWAYS) {
-	fprintf(file, "always all %s\n", trigger->command);
-      } else if (trigger->when == NEVER) {
-	fprintf(file, "never all %s\n", trigger->command);
-      } else {
-	fprintf(file, "trigger all %s\n", trigger->command);
+  for (cp = data; cp < &data[len]; cp++) {
+    c = *cp;
+
+    if (c == '$') {
+      if (rx_state != RX_HUNT) {
+	fprintf(log_file, "! Incomplete TI103 reply dropped\n");
+	rx_resyncs++;
       }
-    } else if (!trigger->command) {
-      if (trigger->when == ALWAYS) {
-	fprintf(file, "always %c%02d %-4s\n",
-		house2name(trigger->house), trigger->unit,
-		func2name(trigger->function));
-      }	else if (trigger->when == NEVER) {
-	fprintf(file, "never %c%02d %-4s\n",
-		house2name(trigger->house), trigger->unit,
-		func2name(trigger->function));
-      } else {
-	fprintf(file, "trigger %c%02d %-4s\n",
-		house2name(trigger->house), trigger->unit,
-		func2name(trigger->function));
+      rx_state = RX_HEADER;
+      rx_header_len = 1;
+      rx_sum = c;
+      rx_body_len = 0;
+      bzero(rx_body, sizeof(rx_body));
+      rx_held = 0;
+      continue;
+    }
+
+    switch (rx_state) {
+    case RX_HUNT:
+      break;			/* noise between replies */
+
+    case RX_HEADER:
+      if (c != TI103_REPLY_GOOD[rx_header_len]) {
+	fprintf(log_file, "! Bad TI103 reply header (0x%02x)\n", c & 0xff);
+	rx_resyncs++;
+	rx_state = RX_HUNT;
+	break;
       }
-    } else {
-      if (trigger->when == ALWAYS) {
-	fprintf(file, "always %c%02d %-4s %s\n",
-		house2name(trigger->house), trigger->unit,
-		func2name(trigger->function), trigger->command);
-      } else if (trigger->when == NEVER) {
-	fprintf(file, "never %c%02d %-4s %s\n",
-		house2name(trigger->house), trigger->unit,
-		func2name(trigger->function), trigger->command);
-      } else {
-	fprintf(file, "trigger %c%02d %-4s %s\n",
-		house2name(trigger->house), trigger->unit,
-		func2name(trigger->function), trigger->command);
+      rx_sum += c;
+      if (++rx_header_len == sizeof(TI103_REPLY_GOOD)-1) {
+	rx_state = RX_BODY;
+      }
+      break;
+
+    case RX_BODY:
+      if (c == '#') {
+	rx_state = RX_HUNT;
+	hi = rx_held == 2 ? hex_value(rx_hold[0]) : -1;
+	lo = rx_held == 2 ? hex_value(rx_hold[1]) : -1;
+	if (hi < 0 || lo < 0 || ((hi << 4) | lo) != (rx_sum & 0xff)) {
+	  fprintf(log_file, "! Bad TI103 reply checksum, wanted %02X\n",
+		  rx_sum & 0xff);
+	  rx_bad_checksums++;
+	  (void)xact_reply(FALSE);
+	  break;
+	}
+	rx_body[rx_body_len] = '\0';
+	rx_frames++;
+	ti103_read_waiting = (xact_reply(TRUE) == XACT_POLL);
+	parse_ti103_frame(rx_body, rx_body_len);
+	break;
+      }
+
+      if (rx_held == 2) {
+	if (rx_body_len >= MAX_REPLY_BODY) {
+	  fprintf(log_file, "! TI103 reply too long, dropped\n");
+	  rx_resyncs++;
+	  rx_state = RX_HUNT;
+	  break;
+	}
+	rx_body[rx_body_len++] = rx_hold[0];
+	rx_sum += rx_hold[0];
+	rx_hold[0] = rx_hold[1];
+	rx_held = 1;
       }
+      rx_hold[rx_held++] = c;
+      break;
     }
   }
-  fflush(file);
+
+  fflush(log_file);
 }
 
 
+/*
+ * Log the commands we're still waiting to see on the wire.
+ */
 static void
-upcase_word (char *cptr) {
+ti103_cmd_print (void) {
+  int		h, u, f;
+  long		now;
+
+  now = now_msecs();
+  fprintf(log_file, "*** %d commands not yet verified ***\n",
+	  verify_outstanding);
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      for (f = 0; f < NUM_FUNCTIONS; f++) {
+	if (verify_sent[h][u][f]) {
+	  fprintf(log_file, "** %c%02d %s sent %ld msecs ago, try %d\n",
+		  house2name(h), u, func2name(f),
+		  now - verify_sent[h][u][f], verify_tries[h][u][f]);
+	}
+      }
+    }
+  }
+  fflush(log_file);
+}
+
+
+/*
+ * Save away TI103 commands which have been written to the device
+ * so they can be verified later.  A resend keeps the class of whoever
+ * sent it first, unless something more urgent has asked for it since.
+ */
+static void
+ti103_cmd_write (char house, int unit, func_value func, priority_t priority) {
+
+  if (unit < 1 || unit > 16 || func == no_function)
+    return;
+
+  ti103_cmd_supersede(house, unit, func);
+  if (verify_sent[(int)house][unit][func] == 0) {
+    verify_outstanding++;
+    verify_tries[(int)house][unit][func] = 0;
+    verify_origin[(int)house][unit][func] = priority;
+  } else if (priority < verify_origin[(int)house][unit][func]) {
+    verify_origin[(int)house][unit][func] = priority;
+  }
+  verify_sent[(int)house][unit][func] = now_msecs();
+  verify_tries[(int)house][unit][func]++;
+
+  if (tty == -1) {
+    printf("Saving command %c%02d %s, try %d\n",
+	   house2name(house), unit, func2name(func),
+	   verify_tries[(int)house][unit][func]);
+  }
+
+  if (verify_outstanding == 1) {
+    arm_timer(verify_timer_fd, verify_timeout, FALSE);
+  }
+}
+
+
+/*
+ * TI103 checksum is the sum of all characters but only
+ * using the two low order bytes.  "buffer" gets the checksum
+ * and the closing '#'.
+ */
+static void
+format_ti103_checksum (char *prefix, char *command, int size, char *buffer) {
   char	*cp;
+  int	i;
 
-  for (cp = cptr ; *cp && !isspace(*cp) ; cp++)
-    if (islower(*cp))
-      *cp = toupper(*cp);
+  i = 0;
+  for (cp = prefix; *cp; cp++) {
+    i += *cp;
+  }
+  for (cp = command; cp < &command[size]; cp++) {
+    i += *cp;
+  }
+
+  sprintf(buffer, "%02X#", i & 0xff);
+  fprintf(log_file, "Checksum=0x%02x\n", i & 0xFF);
 }
 
 
+/*
+ * Write one frame addressing "nunits" units in a house code, followed
+ * by the function.  A single unit has its address sent twice, the
+ * way we always have.
+ */
 static void
-dump_state (char *output_file) {
-  FILE		*file;
-  boolean	got_file;
+write_ti103_command (char house, int *units, int nunits, func_value func,
+		     priority_t priority) {
+  char		command[80];
+  char		checksum[4];
+  struct iovec	iov[3];
+  int		size;
+  int		i;
   
-  got_file = FALSE;
-  if (output_file && *output_file) {
-    file = fopen(output_file, "w");
-    if (file) {
-      got_file = TRUE;
-    }
+  size = 0;
+  if (nunits == 1) {
+    size = snprintf(command, sizeof(command), "%c%02d",
+		    house2name(house), units[0]);
+  }
+  for (i = 0; i < nunits; i++) {
+    size += snprintf(&command[size], sizeof(command) - size, "%c%02d",
+		     house2name(house), units[i]);
   }
+  size += snprintf(&command[size], sizeof(command) - size,
+		   " %c%s%c%s",
+		   house2name(house), func2name(func),
+		   house2name(house), func2name(func));
+
+  fprintf(log_file, "Writing command '%s'\n", command);
+  fflush(log_file);
+
+  poll_activity();		/* watch for it to show up */
 
+  format_ti103_checksum(TI103_COMMAND, command, size, checksum);
+  iov[0].iov_base = TI103_COMMAND;
+  iov[0].iov_len = sizeof(TI103_COMMAND)-1;
+  iov[1].iov_base = command;
+  iov[1].iov_len = size;
+  iov[2].iov_base = checksum;
+  iov[2].iov_len = 3;
   /*
-   * If no output avail., use log_file
+   * Store these away as our last commands written, unless there's no
+   * device to write them to
    */
-  if (!got_file) {
-    file = log_file;
+  if (xact_submit(XACT_COMMAND, iov, 3) || tty == -1) {
+    for (i = 0; i < nunits; i++) {
+      ti103_cmd_write(house, units[i], func, priority);
+    }
   }
 
-  /*
-   * Print any device -> descriptions we know
-   */
-  print_descs(file);
+  if (tty == -1) {
+    char	reply[sizeof(TI103_REPLY_GOOD) + sizeof(command) + 4];
 
-  /*
-   * Dump all device states
-   */
-//  print_status(file, NULL, FALSE);
+    size = snprintf(reply, sizeof(reply), "%s%.*s",
+		    TI103_REPLY_GOOD, size, command);
+    format_ti103_checksum(TI103_REPLY_GOOD, &reply[sizeof(TI103_REPLY_GOOD)-1],
+			  size - (sizeof(TI103_REPLY_GOOD)-1), &reply[size]);
+    ti103_rx(reply, size + 3);
+  }
+}
 
-  /*
-   * Now, dump all triggers
-   */
-  print_triggers(file);
 
-  /*
-   * Any "events" command we have
-   */
-  if (events_file != NULL) {
-    fprintf(file, "events %s\n", events_file);
+/*
+ * Take one frame's worth of commands off the queue and send it.
+ * Starting with the oldest command of the most urgent class waiting,
+ * gather up later ones of that class for the same house code and
+ * function.  A later command can't join if something in between was
+ * for the same unit, so each unit still sees its commands in the
+ * order they were given.
+ */
+static void
+send_x10_frame (void) {
+  ti103_commands	*cmd, *c;
+  char			house;
+  func_value		func;
+  boolean		sent[MAX_PENDING_CMDS];
+  int			units[MAX_FRAME_UNITS];
+  int			nunits;
+  unsigned int		in_frame, blocked;
+  priority_t		pri;
+  long			now, wait;
+  int			i, j, first;
+
+  pri = PRI_INTERACTIVE;
+  while (sched_depth[pri] == 0) {
+    pri++;
+  }
+  for (first = 0; pending_cmds[first].priority != pri; first++) ;
+
+  bzero(sent, sizeof(sent));
+  cmd = &pending_cmds[first];
+  units[0] = cmd->unit;
+  nunits = 1;
+  in_frame = 1 << cmd->unit;
+  blocked = 0;
+  sent[first] = TRUE;
+
+  for (j = first + 1; j < pending_count && nunits < MAX_FRAME_UNITS; j++) {
+    c = &pending_cmds[j];
+    if (c->priority != pri || c->house != cmd->house)
+      continue;
+
+    if (c->func == cmd->func &&
+	!((in_frame | blocked) & (1 << c->unit))) {
+      units[nunits++] = c->unit;
+      in_frame |= 1 << c->unit;
+      sent[j] = TRUE;
+    } else {
+      blocked |= 1 << c->unit;
+    }
   }
 
   /*
-   * And our "commands" command
+   * Note how long they waited and take them off the queue before
+   * writing, since with no TI103 the reply - and whatever it sets
+   * off - comes back from inside write_ti103_command()
    */
-  if (command_file != NULL) {
-    fprintf(file, "commands %s\n", command_file);
+  house = cmd->house;
+  func = cmd->func;
+  now = now_msecs();
+  last_frame_sent = now;
+  for (i = j = 0; i < pending_count; i++) {
+    if (sent[i]) {
+      wait = now - pending_cmds[i].queued;
+      sched_wait_total[pri] += wait;
+      if (wait > sched_wait_max[pri]) {
+	sched_wait_max[pri] = wait;
+      }
+      sched_sent[pri]++;
+      sched_depth[pri]--;
+    } else {
+      pending_cmds[j++] = pending_cmds[i];
+    }
   }
+  pending_count = j;
 
-  fflush(file);
+  write_ti103_command(house, units, nunits, func, pri);
+}
 
-  if (got_file) {
-    fclose(file);
+
+/*
+ * Send what we can.  A frame goes out when the TI103 has nothing of
+ * ours waiting to be sent, and it's been "pace" msecs since the last
+ * one; if we have to wait for that, the timer brings us back.  With no
+ * device (simulating) everything goes at once.
+ */
+static void
+send_x10_commands (void) {
+  static boolean	sending;
+  long			now;
+
+  if (sending)
+    return;			/* the loop below will get to them */
+  sending = TRUE;
+
+  while (pending_count > 0) {
+    if (tty != -1) {
+      if (xact_queued > 0 || xact_in_flight >= xact_window)
+	break;			/* xact_reply() will call us again */
+
+      now = now_msecs();
+      if (pace > 0 && now < last_frame_sent + pace) {
+	arm_timer(sched_timer_fd, last_frame_sent + pace - now, FALSE);
+	break;
+      }
+    }
+
+    send_x10_frame();
   }
+
+  sending = FALSE;
 }
 
 
+/*
+ * Add a command to the ones waiting to go out.  An ON or OFF replaces
+ * a waiting ON or OFF for the same device, unless the waiting one is
+ * more urgent, in which case it stands and this one is dropped.
+ */
 static void
-dump_and_exit (int signum) {
+queue_x10_command (char house, int unit, func_value func,
+		   priority_t priority) {
+  ti103_commands	*c;
+  int			i, j;
+
+  if (func == on || func == off) {
+    for (i = j = 0; i < pending_count; i++) {
+      c = &pending_cmds[i];
+      if (c->house == house && c->unit == unit &&
+	  (c->func == on || c->func == off)) {
+	if (c->priority < priority) {
+	  sched_superseded[priority]++;
+	  return;		/* keep the more urgent one */
+	}
+	sched_superseded[c->priority]++;
+	sched_depth[c->priority]--;
+	continue;
+      }
+      pending_cmds[j++] = *c;
+    }
+    pending_count = j;
+  }
 
-  dump_state(command_file);
-  fclose(log_file);
-  fclose(stdin_file);
-  fclose(events_fd);
+  if (pending_count >= MAX_PENDING_CMDS) {
+    fprintf(log_file, "! Too many commands waiting, dropped %c%d %s\n",
+	    house2name(house), unit, func2name(func));
+    sched_dropped++;
+    return;
+  }
+
+  c = &pending_cmds[pending_count++];
+  c->house = house;
+  c->unit = unit;
+  c->func = func;
+  c->priority = priority;
+  c->queued = now_msecs();
+  sched_depth[priority]++;
+}
+
+
+/*
+ * Would this command just put a device into the state we recently saw
+ * it go into?  Not if something else for it is still on its way,
+ * since that might change it first.
+ */
+static boolean
+command_redundant (int house, int unit, func_value func) {
+  state_value	want;
+  int		i;
+
+  if (suppress_window == 0 || (func != on && func != off))
+    return FALSE;
+
+  want = (func == on) ? state_on : state_off;
+  if (states[house][unit] != want || state_seen[house][unit] == 0 ||
+      now_msecs() - state_seen[house][unit] > suppress_window * 1000L)
+    return FALSE;
+
+  if (verify_sent[house][unit][on] || verify_sent[house][unit][off])
+    return FALSE;
+  for (i = 0; i < pending_count; i++) {
+    if (pending_cmds[i].house == house && pending_cmds[i].unit == unit)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+/*
+ * Set the freshness window for skipping redundant commands:
+ *	suppress <secs>
+ * 0 turns it off.
+ */
+static void
+set_suppress (char *cp) {
+  long		secs;
+  char		*end;
+
+  secs = strtol(cp, &end, 10);
+  if (end == cp || secs < 0) {
+    fprintf(log_file, "! Bad suppress - need secs\n");
+    return;
+  }
+
+  suppress_window = secs;
+  if (suppress_window) {
+    fprintf(log_file, "Skipping commands for states seen in the last %d secs\n",
+	    suppress_window);
+  } else {
+    fprintf(log_file, "Sending every command\n");
+  }
+}
+
+
+/*
+ * Set the minimum time between command frames:
+ *	pace <msecs>
+ */
+static void
+set_pace (char *cp) {
+  long		msecs;
+  char		*end;
+
+  msecs = strtol(cp, &end, 10);
+  if (end == cp || msecs < 0) {
+    fprintf(log_file, "! Bad pace - need msecs\n");
+    return;
+  }
+
+  pace = msecs;
+  fprintf(log_file, "Sending command frames at least %ld msecs apart\n",
+	  pace);
+  send_x10_commands();
+}
+
+
+
+func_value
+state2func(state_value state) 
+{
+    switch ( state ) {
+    case state_on:
+	return on;
+    case state_off:
+	return off;
+    default:
+	return no_function;
+    }
+}
+		
+
+
+/*
+ * Go through the commands we're waiting to see.  Any that are overdue
+ * are sent again, or given up on once they've had their retries.
+ */
+static void
+verify_timer (void) {
+  int		h, u, f;
+  long		now, next, due;
+  boolean	resend;
+
+  now = now_msecs();
+  next = 0;
+  resend = FALSE;
+  for (h = 1; h <= 16 && verify_outstanding > 0; h++) {
+    for (u = 1; u <= 16; u++) {
+      for (f = 0; f < NUM_FUNCTIONS; f++) {
+	if (verify_sent[h][u][f] == 0)
+	  continue;
+
+	due = verify_sent[h][u][f] + verify_timeout;
+	if (due > now) {
+	  if (next == 0 || due < next) {
+	    next = due;
+	  }
+	  continue;
+	}
+
+	verify_missed[h][u]++;
+	if (verify_tries[h][u][f] > verify_retries) {
+	  fprintf(log_file, "! Never saw %c%d %s on the wire after %d tries\n",
+		  house2name(h), u, func2name(f), verify_tries[h][u][f]);
+	  verify_failed[h][u]++;
+	  verify_sent[h][u][f] = 0;
+	  verify_outstanding--;
+	  continue;
+	}
+
+	fprintf(log_file, "Didn't see %c%d %s, sending it again\n",
+		house2name(h), u, func2name(f));
+	verify_sent[h][u][f] = now;	/* not again until it's been sent */
+	queue_x10_command(h, u, f, verify_origin[h][u][f]);
+	resend = TRUE;
+	due = now + verify_timeout;
+	if (next == 0 || due < next) {
+	  next = due;
+	}
+      }
+    }
+  }
+
+  if (resend) {
+    send_x10_commands();
+  }
+  if (verify_outstanding > 0) {
+    arm_timer(verify_timer_fd, next > now ? next - now : 1, FALSE);
+  }
+  fflush(log_file);
+}
+
+
+/*
+ * Perform a full reset of all devices which are "on" or "off" as long
+ * as they're not the house_code and unit_code of the reset trigger itself.
+ */
+void
+reset_x10 (int reset_house, int reset_unit) 
+{
+    int			house;
+    int			unit;
+
+    fprintf(log_file, "Resetting all X10 devices to known state\n");
+    for (house = name2house('A'); house <= name2house('P'); house++) {
+	for (unit = 1; unit <= 16; unit++) {
+	    if ((states[house][unit] == state_on ||
+		 states[house][unit] == state_off) &&
+		!(house == reset_house && unit == reset_unit)) {
+		fprintf(log_file, "Resetting %c%d to %s\n",
+			house2name(house), unit,
+			state2name(states[house][unit]));
+		queue_x10_command(house, unit,
+				  state2func(states[house][unit]), PRI_SWEEP);
+	    }
+	}
+    }
+    send_x10_commands();
+}
+
+
+
+/*************************************************************
+ * Trigger jobs - running trigger commands in the background *
+ *************************************************************/
+
+/*
+ * Start a queued job.  Like system() used to, the command is run by
+ * /bin/sh with stdin and stdout going to /dev/null.
+ */
+static boolean
+start_job (trigger_job *job) {
+  sigset_t			mask;
+  pid_t				pid;
+  char				*shell_command;
+  size_t			len;
+  posix_spawn_file_actions_t	actions;
+  posix_spawnattr_t		attr;
+  int				err;
+
+  if (job->argv) {
+    /*
+     * An "exec" trigger - start the program directly, no shell.
+     */
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr,
+			     POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+				     "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+				     "/dev/null", O_WRONLY, 0);
+    err = posix_spawnp(&pid, job->argv[0], &actions, &attr,
+		       job->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+      fprintf(log_file, "! Can't exec '%s' - errno=%d\n",
+	      job->command, err);
+      return FALSE;
+    }
+    goto started;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    fprintf(log_file, "! Can't fork for '%s' - errno=%d\n",
+	    job->command, errno);
+    return FALSE;
+  }
+
+  if (pid == 0) {
+    /* child - don't keep the signals we block or ignore in the parent */
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    len = strlen(job->command) + sizeof(" </dev/null >/dev/null");
+    shell_command = malloc(len);
+    if (!shell_command)
+      _exit(127);
+    snprintf(shell_command, len, "%s </dev/null >/dev/null", job->command);
+    execl("/bin/sh", "sh", "-c", shell_command, (char *)NULL);
+    _exit(127);
+  }
+
+ started:
+  job->pid = pid;
+  job->started = now_msecs();
+  job->next = jobs_running;
+  jobs_running = job;
+  jobs_active++;
+  jobs_started++;
+  job_busy[job->house][job->unit] = TRUE;
+
+  return TRUE;
+}
+
+
+/*
+ * Start as many queued jobs as we're allowed to, skipping any for
+ * a house/unit that already has one running.
+ */
+static void
+run_jobs (void) {
+  trigger_job	*job, *prev;
+
+  prev = NULL;
+  job = job_queue;
+  while (job && jobs_active < max_jobs) {
+    if (job_busy[job->house][job->unit]) {
+      prev = job;
+      job = job->next;
+      continue;
+    }
+
+    /* take it off the queue */
+    if (prev) {
+      prev->next = job->next;
+    } else {
+      job_queue = job->next;
+    }
+    if (job_queue_tail == job) {
+      job_queue_tail = prev;
+    }
+    jobs_queued--;
+
+    if (!start_job(job)) {
+      free(job->command);
+      free(job->argv);
+      free(job);
+    }
+    job = prev ? prev->next : job_queue;
+  }
+}
+
+
+/*
+ * Queue a trigger command to be run for a house code and unit number.
+ * If "argv" is given, it's run directly rather than by the shell and
+ * the job takes it over.
+ */
+static void
+queue_job (int house, int unit, char *command, char **argv) {
+  trigger_job	*job;
+
+  if (jobs_queued >= MAX_QUEUED_JOBS) {
+    fprintf(log_file, "! Too many triggers waiting, dropping '%s'\n",
+	    command);
+    jobs_dropped++;
+    free(argv);
+    return;
+  }
+
+  job = malloc(sizeof(*job));
+  if (!job) {
+    free(argv);
+    return;
+  }
+
+  job->command = strdup(command);
+  if (!job->command) {
+    free(job);
+    free(argv);
+    return;
+  }
+  job->argv = argv;
+  job->house = house;
+  job->unit = unit;
+  job->pid = 0;
+  job->next = NULL;
+
+  if (job_queue_tail) {
+    job_queue_tail->next = job;
+  } else {
+    job_queue = job;
+  }
+  job_queue_tail = job;
+  jobs_queued++;
+
+  run_jobs();
+}
+
+
+/*
+ * Collect any children that have finished, log how they did, and
+ * start whatever was waiting on them.
+ */
+static void
+reap_jobs (void) {
+  trigger_job	**jp, *job;
+  pid_t		pid;
+  int		status;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == coproc_pid) {
+      coproc_exited(status);
+      continue;
+    }
+    if (pid == save_pid) {
+      save_exited(status);
+      continue;
+    }
+
+    for (jp = &jobs_running; *jp; jp = &(*jp)->next) {
+      if ((*jp)->pid == pid)
+	break;
+    }
+    if (!*jp)
+      continue;			/* not one of ours */
+
+    job = *jp;
+    *jp = job->next;
+    jobs_active--;
+    job_busy[job->house][job->unit] = FALSE;
+
+    if (WIFEXITED(status)) {
+      fprintf(log_file, "%c%d> %s returns %d (%ld msecs)\n",
+	      house2name(job->house), job->unit, job->command,
+	      WEXITSTATUS(status), now_msecs() - job->started);
+    } else if (WIFSIGNALED(status)) {
+      fprintf(log_file, "%c%d> %s killed by signal %d (%ld msecs)\n",
+	      house2name(job->house), job->unit, job->command,
+	      WTERMSIG(status), now_msecs() - job->started);
+    }
+    free(job->command);
+    free(job->argv);
+    free(job);
+  }
+  fflush(log_file);
+
+  run_jobs();
+}
+
+
+/*
+ * Set how many trigger commands may run at once:
+ *	jobs <count>
+ */
+static void
+set_max_jobs (char *cp) {
+  int		count;
+
+  count = atoi(cp);
+  if (count < 1) {
+    fprintf(log_file, "! Bad jobs count '%s'\n", cp);
+    return;
+  }
+
+  max_jobs = count;
+  fprintf(log_file, "Running up to %d triggers at once\n", max_jobs);
+  run_jobs();
+}
+
+
+/*************************************************************
+ * Coprocess - one long running handler fed a line per event *
+ *************************************************************/
+
+/*
+ * Start the coprocess with a pipe to its stdin.
+ */
+static void
+start_coproc (void) {
+  sigset_t	mask;
+  int		fds[2];
+  int		null;
+  pid_t		pid;
+
+  if (!coproc_command || coproc_pid)
+    return;
+
+  if (pipe(fds) < 0) {
+    fprintf(log_file, "! Can't make coprocess pipe - errno=%d\n", errno);
+    return;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  pid = fork();
+  if (pid < 0) {
+    fprintf(log_file, "! Can't fork coprocess - errno=%d\n", errno);
+    close(fds[0]);
+    close(fds[1]);
+    arm_timer(coproc_timer_fd, coproc_backoff * 1000L, FALSE);
+    return;
+  }
+
+  if (pid == 0) {
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    dup2(fds[0], STDIN_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+    }
+    execl("/bin/sh", "sh", "-c", coproc_command, (char *)NULL);
+    _exit(127);
+  }
+
+  close(fds[0]);
+  coproc_fd = fds[1];
+  fcntl(coproc_fd, F_SETFL, fcntl(coproc_fd, F_GETFL) | O_NONBLOCK);
+  coproc_pid = pid;
+  coproc_started = now_msecs();
+  fprintf(log_file, "Started coprocess %d: %s\n", pid, coproc_command);
+
+  coproc_flush();		/* anything saved up for it */
+}
+
+
+/*
+ * Stop listening to the coprocess pipe and close it.
+ */
+static void
+close_coproc (void) {
+
+  if (coproc_fd == -1)
+    return;
+
+  if (coproc_watching) {
+    reactor_del(coproc_fd);
+    coproc_watching = FALSE;
+  }
+  close(coproc_fd);
+  coproc_fd = -1;
+}
+
+
+/*
+ * Write out as much of the buffer as the pipe will take.  If it
+ * won't take it all, wait until it has room.
+ */
+static void
+coproc_flush (void) {
+  size_t	chunk;
+  ssize_t	ret;
+
+  while (coproc_len > 0 && coproc_fd != -1) {
+    chunk = coproc_len;
+    if (coproc_head + chunk > sizeof(coproc_buffer)) {
+      chunk = sizeof(coproc_buffer) - coproc_head;
+    }
+
+    ret = write(coproc_fd, &coproc_buffer[coproc_head], chunk);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN) {
+	if (!coproc_watching) {
+	  coproc_watching = reactor_add(coproc_fd, EPOLLOUT);
+	}
+	return;
+      }
+      /* EPIPE - it's gone, SIGCHLD will tell us the rest */
+      close_coproc();
+      return;
+    }
+
+    coproc_head = (coproc_head + ret) % sizeof(coproc_buffer);
+    coproc_len -= ret;
+  }
+
+  if (coproc_len == 0) {
+    coproc_head = 0;
+  }
+  if (coproc_watching && coproc_len == 0) {
+    reactor_del(coproc_fd);
+    coproc_watching = FALSE;
+  }
+}
+
+
+/*
+ * Hand an event to the coprocess as one tab separated line:
+ *	house unit function description time
+ */
+static void
+coproc_event (int house, int unit, func_value func) {
+  char		line[256];
+  size_t	len, tail, first;
+
+  if (!coproc_command)
+    return;
+
+  if (!coproc_template) {
+    coproc_template = compile_template("%h\t%u\t%f\t%d\t%t", TRUE);
+  }
+  len = expand_template(coproc_template, line, sizeof(line) - 1,
+			house, unit, func);
+  if ((int)len < 0) {
+    len = strlen(line);
+  }
+  line[len++] = '\n';
+
+  if (coproc_len + len > sizeof(coproc_buffer)) {
+    coproc_dropped++;		/* it's not keeping up */
+    return;
+  }
+
+  tail = (coproc_head + coproc_len) % sizeof(coproc_buffer);
+  first = sizeof(coproc_buffer) - tail;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(&coproc_buffer[tail], line, first);
+  memcpy(coproc_buffer, &line[first], len - first);
+  coproc_len += len;
+  coproc_lines++;
+
+  coproc_flush();
+}
+
+
+/*
+ * The coprocess has exited.  Start it again after a while, waiting
+ * longer each time unless it had been running happily for a bit.
+ */
+static void
+coproc_exited (int status) {
+
+  if (WIFEXITED(status)) {
+    fprintf(log_file, "Coprocess %d exited with %d\n",
+	    coproc_pid, WEXITSTATUS(status));
+  } else if (WIFSIGNALED(status)) {
+    fprintf(log_file, "Coprocess %d killed by signal %d\n",
+	    coproc_pid, WTERMSIG(status));
+  }
+  close_coproc();
+  coproc_pid = 0;
+  arm_timer(coproc_timer_fd, 0, FALSE);
+
+  if (!coproc_command)
+    return;
+
+  if (now_msecs() - coproc_started > COPROC_STABLE * 1000L) {
+    coproc_backoff = MIN_COPROC_RESTART;
+  }
+  fprintf(log_file, "Restarting coprocess in %d seconds\n", coproc_backoff);
+  arm_timer(coproc_timer_fd, coproc_backoff * 1000L, FALSE);
+  coproc_backoff *= 2;
+  if (coproc_backoff > MAX_COPROC_RESTART) {
+    coproc_backoff = MAX_COPROC_RESTART;
+  }
+  coproc_restarts++;
+}
+
+
+/*
+ * Set the coprocess command, replacing any one already running:
+ *	coprocess <command>
+ * With no command, just stop it.
+ */
+static void
+set_coproc (char *cp) {
+
+  free(coproc_command);
+  coproc_command = NULL;
+  if (*cp) {
+    coproc_command = strdup(cp);
+  }
+  coproc_backoff = MIN_COPROC_RESTART;
+
+  if (coproc_pid) {
+    /*
+     * Close the old one's stdin so it can finish what it has, and
+     * kill it if it's still around after COPROC_GRACE.  The new one
+     * starts once it's gone.
+     */
+    close_coproc();
+    arm_timer(coproc_timer_fd, COPROC_GRACE * 1000L, FALSE);
+    return;
+  }
+
+  start_coproc();
+}
+
+
+/*
+ * The coprocess timer went off.  Either it's time to restart it, or an
+ * old one hasn't gone away after we closed its stdin.
+ */
+static void
+coproc_timer (void) {
+
+  if (coproc_pid && coproc_fd == -1) {
+    kill(coproc_pid, SIGTERM);
+    return;
+  }
+
+  start_coproc();
+}
+
+
+/*
+ * Build the argument list for an "exec" trigger.  Only the arguments
+ * with substitutions need any work; the rest are copied as they are.
+ * Everything is in one block, so one free() gets rid of it.
+ */
+static char **
+expand_argv (x10_trigger *trigger, int house, int unit, func_value func) {
+  char		**argv;
+  char		*cp;
+  int		argc, i;
+  size_t	size;
+
+  size = sizeof(char *);
+  for (argc = 0; trigger->argv[argc]; argc++) {
+    size += sizeof(char *);
+    if (trigger->argv_templates[argc]) {
+      size += MAX_EXPANDED_ARG;
+    } else {
+      size += strlen(trigger->argv[argc]) + 1;
+    }
+  }
+
+  argv = malloc(size);
+  if (!argv)
+    return NULL;
+
+  cp = (char *)&argv[argc + 1];
+  for (i = 0; i < argc; i++) {
+    argv[i] = cp;
+    if (trigger->argv_templates[i]) {
+      if (expand_template(trigger->argv_templates[i], cp, MAX_EXPANDED_ARG,
+			  house, unit, func) < 0) {
+	fprintf(log_file, "! Argument %d of '%s' truncated\n",
+		i, trigger->command);
+      }
+      cp += MAX_EXPANDED_ARG;
+    } else {
+      strcpy(cp, trigger->argv[i]);
+      cp += strlen(cp) + 1;
+    }
+  }
+  argv[argc] = NULL;
+
+  return argv;
+}
+
+
+/*
+ * Expand a shell trigger's command into "buffer".
+ */
+static void
+expand_command (x10_trigger *trigger, char *buffer, int bufsize,
+		int house, int unit, func_value func) {
+
+  if (expand_template(trigger->template, buffer, bufsize,
+		      house, unit, func) < 0) {
+    fprintf(log_file, "! Command '%s' truncated\n", trigger->command);
+  }
+}
+
+
+/*
+ * Take a token from a trigger's bucket if it has a "rate".  The bucket
+ * holds up to N and fills at N every S seconds.
+ */
+static boolean
+trigger_allowed (x10_trigger *trigger) {
+  long		now;
+
+  if (trigger->opts.per == 0)
+    return TRUE;
+
+  now = now_msecs();
+  trigger->tokens += (double)(now - trigger->refilled) * trigger->opts.rate
+		     / (trigger->opts.per * 1000.0);
+  if (trigger->tokens > trigger->opts.rate) {
+    trigger->tokens = trigger->opts.rate;
+  }
+  trigger->refilled = now;
+
+  if (trigger->tokens < 1.0) {
+    trigger->limited++;
+    return FALSE;
+  }
+
+  trigger->tokens -= 1.0;
+  return TRUE;
+}
+
+
+void
+perform_trigger (x10_trigger *trigger, int house, int unit, func_value func) {
+  char		buffer[MAX_EXPANDED_COMMAND];
+
+  if (!trigger_allowed(trigger)) {
+    fprintf(log_file, "Rate limited: %c%d %s\n",
+	    house2name(house), unit, func2name(func));
+    return;
+  }
+
+  /*
+   * If the command is a zero length string, then it's a reset-all
+   */
+  if (trigger->command == NULL) {
+      fprintf(log_file, "Requesting reset\n");
+      reset_x10(house, unit);
+
+      fflush(log_file);
+      return;
+  }
+  
+  /*
+   * Perform the command
+   */
+  fprintf(log_file, "%s: %c%d%s> %s\n",
+	  trigger->argv ? "Exec" :
+	  (trigger->when == TRANSITION) ? "Trigger" : "Always",
+	  house2name(house), unit, func2name(func),
+	  trigger->command);
+  if (trigger->argv) {
+    queue_job(house, unit, trigger->command,
+	      expand_argv(trigger, house, unit, func));
+  } else {
+    expand_command(trigger, buffer, sizeof(buffer), house, unit, func);
+    queue_job(house, unit, buffer, NULL);
+  }
+}
+
+/*
+ * Perform the function associated with the house code and unit number.
+ */
+static boolean
+function_trigger (int house, int unit, func_value func, when_t when,
+		  boolean local) {
+  x10_trigger	*trigger;
+  char		*cmd;
+
+  trigger = find_trigger(house, unit, func, when);
+  if (!trigger)
+    return FALSE;
+  if (local && trigger->opts.remote)
+    return TRUE;		/* not for our own commands */
+
+  perform_trigger(trigger, house, unit, func);
+
+  return TRUE;
+}
+
+
+static void
+all_trigger (int house, int unit, func_value func, boolean local) {
+  x10_trigger	*trigger;
+  char		buffer[MAX_EXPANDED_COMMAND];
+
+  coproc_event(house, unit, func);
+
+  trigger = find_trigger(0, 0, no_function, NONE);
+  if (!trigger || !trigger->command)
+    return;
+  if (local && trigger->opts.remote)
+    return;
+  if (!trigger_allowed(trigger)) {
+    fprintf(log_file, "Rate limited: all %c%d %s\n",
+	    house2name(house), unit, func2name(func));
+    return;
+  }
+
+  if (trigger->argv) {
+    fprintf(log_file, "Exec: %c%d%s> %s\n",
+	    house2name(house), unit, func2name(func),
+	    trigger->command);
+    queue_job(house, unit, trigger->command,
+	      expand_argv(trigger, house, unit, func));
+    return;
+  }
+
+  expand_command(trigger, buffer, sizeof(buffer), house, unit, func);
+
+  fprintf(log_file, "Trigger: %c%d%s> %s\n",
+	  house2name(house), unit, func2name(func),
+	  buffer);
+  queue_job(house, unit, buffer, NULL);
+}
+
+
+static char *
+skip_spaces (char *cp) {
+
+  while (*cp && isspace(*cp)) cp++;
+
+  return cp;
+}
+
+
+static char *
+skip_until_space (char *cp) {
+
+  while (*cp && !isspace(*cp)) cp++;
+
+  return cp;
+}
+
+
+static char *
+skip_digits (char *cp) {
+
+  while (*cp && isdigit(*cp)) cp++;
+
+  return cp;
+}
+
+
+/*
+ * Parse a house and unit code
+ * Side-effects:
+ *	sets *ahouse to the house code number
+ *	sets *aunit to the unit number
+ *	updates *cptr to pointer after parsed items
+ * Considerations:
+ *	takes either upper or lower case
+ * Returns TRUE only if both are parsed correctly
+ */
+static boolean
+parse_house_unit (char **cptr, char *ahouse, int *aunit) {
+  char	house;
+  int	unit;
+  char 	*cp;
+  
+  cp = *cptr;
+  if ((*cp >= 'A' && *cp <= 'P') ||
+      (*cp >= 'a' && *cp <= 'p')) {
+    house = name2house(*cp);
+    cp++;
+
+    cp = skip_spaces(cp);
+    if (isdigit(*cp)) {
+      unit = atoi(cp);
+      while (isdigit(*cp)) cp++;
+
+      *ahouse = house;
+      *aunit = unit;
+      *cptr = cp;		/* update our pointer */
+      return TRUE;		/* got both */
+    }
+
+    return FALSE;		/* incomplete */
+  }
+
+  return FALSE;			/* incomplete */
+}
+
+
+/*
+ * Read whatever the TI103 has sent.  Everything read goes straight to
+ * the reply parser, which carries on where it left off next time.
+ */
+void
+read_ti103 (void) {
+  char		buffer[128];
+  int		ret;
+
+  while (TRUE) {
+    ret = read(tty, buffer, sizeof(buffer) - 1);
+    if (ret == 0) {
+      return;			/* hung up - main loop deals with it */
+    } else if (ret == -1) {
+      if (errno == EINTR)
+	continue;
+      return;			/* EAGAIN - drained */
+    }
+    buffer[ret] = '\0';
+    if (strcmp(buffer, TI103_REPLY_NULL) != 0) {
+      fprintf(log_file, "Read TI103: (%d bytes)'%s'\n", ret, buffer);
+    }
+
+    ti103_rx(buffer, ret);
+  }
+}
+
+
+/*
+ * Write command to Ti103 which tells it to send us whatever
+ * X10 commands it has saved in its buffer.
+ */
+static void
+get_ti103_status (int sig) {
+  struct iovec	iov;
+
+  if (tty == -1)
+    return;
+
+  if (xact_polls > 0)
+    return;			/* one's already on its way */
+
+  if (verbose)
+    fprintf(log_file, "Reading status\n");
+  iov.iov_base = TI103_READ_BUFFER;
+  iov.iov_len = sizeof(TI103_READ_BUFFER)-1;
+  if (xact_submit(XACT_POLL, &iov, 1)) {
+    polls_issued++;
+  }
+}
+
+
+/*
+ * Work out when to poll the buffer next.  Stay at "poll_min" while
+ * we're inside the burst window, otherwise back off towards "poll_max".
+ */
+static void
+schedule_poll (void) {
+
+  if (tty == -1)
+    return;
+
+  if (now_msecs() - last_activity < poll_burst) {
+    poll_interval = poll_min;
+  } else {
+    poll_interval *= poll_decay;
+    if (poll_interval > poll_max) {
+      poll_interval = poll_max;
+    }
+    if (poll_interval < poll_min) {
+      poll_interval = poll_min;
+    }
+  }
+
+  arm_timer(poll_timer_fd, poll_interval, FALSE);
+}
+
+
+/*
+ * Something happened on the powerline, or we're about to make
+ * something happen.  Go back to polling quickly.
+ */
+static void
+poll_activity (void) {
+
+  last_activity = now_msecs();
+  if (poll_interval > poll_min && tty != -1) {
+    poll_interval = poll_min;
+    arm_timer(poll_timer_fd, poll_interval, FALSE);
+  }
+}
+
+
+/*
+ * Try to open the TI103.  If it isn't there, try again later, backing
+ * off each time up to MAX_RECONNECT_INTERVAL.
+ */
+static void
+connect_ti103 (void) {
+
+  tty = init_ti103();
+  if (tty == -1) {
+    arm_timer(reconnect_timer_fd, reconnect_interval * 1000L, FALSE);
+    reconnect_interval *= 2;
+    if (reconnect_interval > MAX_RECONNECT_INTERVAL) {
+      reconnect_interval = MAX_RECONNECT_INTERVAL;
+    }
+    return;
+  }
+
+  fprintf(log_file, "Opened TI103 device %s\n", device);
+  reconnect_interval = MIN_RECONNECT_INTERVAL;
+  reactor_add(tty, EPOLLIN);
+  last_activity = now_msecs();
+  poll_interval = poll_min;
+  arm_timer(poll_timer_fd, poll_interval, FALSE);
+}
+
+
+/*
+ * The device went away (unplugged, most likely).  Close it, stop
+ * polling it and start trying to get it back.
+ */
+static void
+hangup_ti103 (void) {
+
+  fprintf(log_file, "! Lost TI103 device\n");
+  reactor_del(tty);
+  close(tty);
+  tty = -1;
+  rx_state = RX_HUNT;
+  tx_head = 0;
+  tx_len = 0;			/* half a frame is no use to the next one */
+  tx_watching = FALSE;
+  xact_reset();
+  arm_timer(poll_timer_fd, 0, FALSE);
+  arm_timer(reconnect_timer_fd, reconnect_interval * 1000L, FALSE);
+}
+
+
+static void
+print_status (FILE *fd,
+	      char *output_file,
+	      boolean desc) {
+  int		i, j;
+  FILE		*file;
+  boolean	got_file;
+  
+  got_file = FALSE;
+  file = NULL;
+  if (fd) {			/* use output FD first */
+    file = fd;
+  } else if (output_file && *output_file) { /* filename 2nd */
+    file = fopen(output_file, "a");
+    if (file) {
+      got_file = TRUE;
+    }
+  }
+
+  if (!file) {			/* of log_file last */
+    file = log_file;
+  }
+
+  for (i = 1 ; i <= 16 ; i++) {
+    for (j = 1 ; j <= 16 ; j++) {
+      if (states[i][j] != undefined) {
+	if (desc) {
+	  fprintf(file, "%s %-4s\n",
+		  x10_description(i, j),
+		  state2name(states[i][j]));
+	} else {
+	  fprintf(file, "%c %d %-4s\n",
+		  house2name(i), j,
+		  state2name(states[i][j]));
+	}
+      }
+    }
+  }
+  fflush(file);
+
+  if (got_file) {
+    fclose(file);
+  }
+}
+
+
+/*
+ * Answer a history query, newest last, to the same places
+ * print_status() would:
+ *	history <house><unit>|all [last <n>] [since <secs>]
+ *		[from <epoch secs>] [to <epoch secs>] [<output file>]
+ * Without "since" or "from" it's the last few records.  Records are
+ * found working back from the newest - along the device's chain for
+ * one device - so the cost is what's printed, not the file's size.
+ */
+static void
+print_history (FILE *fd, char *cp) {
+  FILE			*file;
+  boolean		got_file;
+  char			house;
+  int			unit;
+  int64_t		from, to, value;
+  uint32_t		limit, nfound, size, n, start, count, i;
+  history_record	*found, *recs, rec;
+  boolean		done;
+  char			*end, stamp[32];
+  time_t		t;
+  struct tm		tm;
+
+  house = 0;
+  unit = 0;
+  if (strncasecmp(cp, "all", 3) == 0) {
+    cp = skip_until_space(cp);
+  } else if (!parse_house_unit(&cp, &house, &unit) || unit == 0) {
+    fprintf(log_file, "! Bad history query - need house unit or all\n");
+    return;
+  }
+
+  from = -1;
+  to = INT64_MAX;
+  limit = 0;
+  while (TRUE) {
+    cp = skip_spaces(cp);
+    end = skip_until_space(cp);
+    value = strtoll(skip_spaces(end), NULL, 10);
+    if (strncasecmp(cp, "last", end - cp) == 0 && end - cp == 4) {
+      limit = value;
+    } else if (strncasecmp(cp, "since", end - cp) == 0 && end - cp == 5) {
+      from = epoch_msecs() - value * 1000;
+    } else if (strncasecmp(cp, "from", end - cp) == 0 && end - cp == 4) {
+      from = value * 1000;
+    } else if (strncasecmp(cp, "to", end - cp) == 0 && end - cp == 2) {
+      to = value * 1000 + 999;
+    } else {
+      break;			/* output file, if any */
+    }
+    cp = skip_until_space(skip_spaces(end));
+  }
+  if (limit == 0) {
+    limit = (from < 0) ? DEFAULT_HISTORY_LAST : HISTORY_NONE;
+  }
+
+  got_file = FALSE;
+  file = NULL;
+  if (fd) {
+    file = fd;
+  } else if (*cp) {
+    file = fopen(cp, "a");
+    if (file) {
+      got_file = TRUE;
+    }
+  }
+  if (!file) {
+    file = log_file;
+  }
+
+  if (history_fd == -1) {
+    fprintf(file, "No history\n");
+    if (got_file) {
+      fclose(file);
+    }
+    return;
+  }
+
+  found = NULL;
+  size = 0;
+  nfound = 0;
+  recs = NULL;
+  done = FALSE;
+  if (house) {
+    for (n = history_last[(int)house][unit]; n != HISTORY_NONE && !done;
+	 n = rec.prev) {
+      if (!history_read(n, &rec, 1))
+	break;
+      if (rec.msecs > to)
+	continue;
+      if (rec.msecs < from || nfound >= limit)
+	break;
+      if (nfound == size) {
+	size = size ? size * 2 : 64;
+	found = realloc(found, size * sizeof(*found));
+      }
+      found[nfound++] = rec;
+    }
+  } else {
+    recs = malloc(HISTORY_SCAN * sizeof(*recs));
+    n = (to == INT64_MAX) ? history_count : history_find(to + 1);
+    for (; n > 0 && !done && recs; n = start) {
+      start = (n > HISTORY_SCAN) ? n - HISTORY_SCAN : 0;
+      count = n - start;
+      if (!history_read(start, recs, count))
+	break;
+      for (i = count; i-- > 0; ) {
+	if (recs[i].msecs > to)
+	  continue;
+	if (recs[i].msecs < from || nfound >= limit) {
+	  done = TRUE;
+	  break;
+	}
+	if (nfound == size) {
+	  size = size ? size * 2 : 64;
+	  found = realloc(found, size * sizeof(*found));
+	}
+	found[nfound++] = recs[i];
+      }
+    }
+    free(recs);
+  }
+
+  for (i = nfound; i-- > 0; ) {
+    t = found[i].msecs / 1000;
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(file, "%s.%03d %c%-2d %-4s %s\n", stamp,
+	    (int)(found[i].msecs % 1000), house2name(found[i].house),
+	    found[i].unit, func2name(found[i].function),
+	    found[i].origin ? priority_names[found[i].origin - 1] : "remote");
+  }
+  free(found);
+  fflush(file);
+
+  if (got_file) {
+    fclose(file);
+  }
+}
+
+
+/*
+ * Print out our counters, to the same places print_status() would.
+ */
+static void
+print_stats (char *output_file) {
+  FILE		*file;
+  boolean	got_file;
+  int		h, u;
+  priority_t	pri;
+  x10_trigger	*trigger;
+
+  got_file = FALSE;
+  file = NULL;
+  if (output_file && *output_file) {
+    file = fopen(output_file, "a");
+    if (file) {
+      got_file = TRUE;
+    }
+  }
+
+  if (!file) {
+    file = log_file;
+  }
+
+  fprintf(file, "polls %lu frames %lu interval %ld\n",
+	  polls_issued, poll_frames, poll_interval);
+  fprintf(file, "replies %lu bad checksums %lu resyncs %lu\n",
+	  rx_frames, rx_bad_checksums, rx_resyncs);
+  fprintf(file, "requests out %d waiting %d sent %lu acked %lu retries %lu timeouts %lu failed %lu\n",
+	  xact_in_flight, xact_queued, xact_sent, xact_acked,
+	  xact_retries, xact_timeouts, xact_failed);
+  fprintf(file, "output waiting %lu queued %lu dropped %lu\n",
+	  (unsigned long)tx_len, tx_queued, tx_dropped);
+  fprintf(file, "triggers running %d queued %d started %lu dropped %lu\n",
+	  jobs_active, jobs_queued, jobs_started, jobs_dropped);
+  if (coproc_command) {
+    fprintf(file, "coprocess %d lines %lu dropped %lu restarts %lu\n",
+	    coproc_pid, coproc_lines, coproc_dropped, coproc_restarts);
+  }
+  for (pri = PRI_INTERACTIVE; pri < NUM_PRIORITIES; pri++) {
+    fprintf(file, "queue %s waiting %d sent %lu superseded %lu wait %ld/%ld\n",
+	    priority_names[pri], sched_depth[pri], sched_sent[pri],
+	    sched_superseded[pri],
+	    sched_sent[pri] ? sched_wait_total[pri] / (long)sched_sent[pri] : 0L,
+	    sched_wait_max[pri]);
+  }
+  if (sched_dropped) {
+    fprintf(file, "queue dropped %lu\n", sched_dropped);
+  }
+  if (events_file) {
+    fprintf(file, "events logged %lu waiting %lu writes %lu dropped %lu rotations %lu\n",
+	    events_logged, (unsigned long)events_len, events_writes,
+	    events_dropped, events_rotations);
+  }
+  if (history_fd != -1) {
+    fprintf(file, "history records %u\n", history_count);
+  }
+  if (journal_fd != -1) {
+    fprintf(file, "journal records %lu snapshots %lu\n",
+	    journal_appended, journal_snapshots);
+  }
+  if (command_file) {
+    fprintf(file, "saves %lu failed %lu%s\n", saves, saves_failed,
+	    save_pid > 0 ? " (saving)" : "");
+  }
+  if (inotify_fd != -1) {
+    fprintf(file, "reloads %lu\n", reloads);
+  }
+  if (control_fd != -1 || control_nclients) {
+    fprintf(file, "control clients %d accepted %lu commands %lu\n",
+	    control_nclients, control_accepted, control_commands);
+  }
+  fprintf(file, "suppressed %lu\n", suppressed);
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      if (debounced[h][u]) {
+	fprintf(file, "%c%-2d debounced %lu\n", house2name(h), u,
+		debounced[h][u]);
+      }
+    }
+  }
+  for (trigger = trigger_list; trigger; trigger = trigger->next) {
+    if (trigger->limited) {
+      if (trigger->house == 0 && trigger->unit == 0) {
+	fprintf(file, "all  %-4s rate limited %lu\n",
+		func2name(trigger->function), trigger->limited);
+      } else {
+	fprintf(file, "%c%-2d %-4s rate limited %lu\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function), trigger->limited);
+      }
+    }
+  }
+  fprintf(file, "unverified %d\n", verify_outstanding);
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      if (verify_seen[h][u] || verify_missed[h][u]) {
+	fprintf(file, "%c%-2d seen %lu missed %lu failed %lu rtt %ld/%ld\n",
+		house2name(h), u, verify_seen[h][u], verify_missed[h][u],
+		verify_failed[h][u],
+		verify_seen[h][u] ? verify_rtt_total[h][u] / (long)verify_seen[h][u] : 0L,
+		verify_rtt_max[h][u]);
+      }
+    }
+  }
+  fflush(file);
+
+  if (got_file) {
+    fclose(file);
+  }
+}
+
+
+/*
+ * Set the buffer polling parameters:
+ *	poll <min msecs> <max msecs> <decay> [<burst msecs>]
+ */
+static void
+set_poll (char *cp) {
+  long		min, max, burst;
+  double	decay;
+  char		*end;
+
+  min = strtol(cp, &end, 10);
+  cp = skip_spaces(end);
+  max = strtol(cp, &end, 10);
+  cp = skip_spaces(end);
+  decay = strtod(cp, &end);
+  cp = skip_spaces(end);
+  burst = poll_burst;
+  if (isdigit(*cp)) {
+    burst = strtol(cp, &end, 10);
+  }
+
+  if (min < 10 || max < min || decay < 1.0) {
+    fprintf(log_file, "! Bad poll settings - need min max decay [burst]\n");
+    return;
+  }
+
+  poll_min = min;
+  poll_max = max;
+  poll_decay = decay;
+  poll_burst = burst;
+  fprintf(log_file, "Polling every %ld-%ld msecs, decay %g, burst %ld\n",
+	  poll_min, poll_max, poll_decay, poll_burst);
+
+  poll_interval = poll_max;	/* reschedule with the new numbers */
+  poll_activity();
+}
+
+
+/*
+ * Set the transaction window:
+ *	window <requests> [<timeout msecs> [<tries>]]
+ */
+static void
+set_window (char *cp) {
+  long		window, timeout, tries;
+  char		*end;
+
+  window = strtol(cp, &end, 10);
+  cp = skip_spaces(end);
+  timeout = xact_timeout;
+  tries = xact_tries;
+  if (isdigit(*cp)) {
+    timeout = strtol(cp, &end, 10);
+    cp = skip_spaces(end);
+    if (isdigit(*cp)) {
+      tries = strtol(cp, &end, 10);
+    }
+  }
+
+  if (window < 1 || timeout < 100 || tries < 1) {
+    fprintf(log_file, "! Bad window settings - need requests [timeout [tries]]\n");
+    return;
+  }
+
+  xact_window = window;
+  xact_timeout = timeout;
+  xact_tries = tries;
+  fprintf(log_file, "Up to %d TI103 requests out, %ld msecs timeout, %d tries\n",
+	  xact_window, xact_timeout, xact_tries);
+
+  xact_pump();
+}
+
+
+/*
+ * Set how long to wait to see our commands on the wire, and how many
+ * times to send them again if we don't:
+ *	verify <timeout msecs> [<retries>]
+ */
+static void
+set_verify (char *cp) {
+  long		timeout, retries;
+  char		*end;
+
+  timeout = strtol(cp, &end, 10);
+  cp = skip_spaces(end);
+  retries = verify_retries;
+  if (isdigit(*cp)) {
+    retries = strtol(cp, &end, 10);
+  }
+
+  if (timeout < 100 || retries < 0) {
+    fprintf(log_file, "! Bad verify settings - need timeout [retries]\n");
+    return;
+  }
+
+  verify_timeout = timeout;
+  verify_retries = retries;
+  fprintf(log_file, "Verifying commands within %ld msecs, %d retries\n",
+	  verify_timeout, verify_retries);
+}
+
+
+/*
+ * Set the window for ignoring repeats, for every device or just one:
+ *	debounce [<house><unit>] <msecs>
+ * 0 turns it off; for one device, 0 goes back to the default.
+ */
+static void
+set_debounce (char *cp) {
+  char		house;
+  int		unit;
+  long		msecs;
+  char		*end;
+
+  house = 0;
+  unit = 0;
+  if (isalpha(*cp)) {
+    if (!parse_house_unit(&cp, &house, &unit) || unit == 0) {
+      fprintf(log_file, "! Bad debounce - need [house unit] msecs\n");
+      return;
+    }
+    cp = skip_spaces(cp);
+  }
+
+  msecs = strtol(cp, &end, 10);
+  if (end == cp || msecs < 0) {
+    fprintf(log_file, "! Bad debounce - need [house unit] msecs\n");
+    return;
+  }
+
+  if (house == 0) {
+    debounce_default = msecs;
+    fprintf(log_file, "Ignoring repeats within %ld msecs\n", msecs);
+  } else {
+    debounce_msecs[(int)house][unit] = msecs;
+    fprintf(log_file, "Ignoring repeats from %c%d within %ld msecs\n",
+	    house2name(house), unit, msecs ? msecs : debounce_default);
+  }
+}
+
+
+/*
+ * Set where events go and how:
+ *	events [json] [daily] [rotate=<bytes>[k|m|g]] [flush=<msecs>] <file>
+ * With no file, events aren't logged.
+ */
+static void
+set_events (char *cp) {
+  boolean	json, daily;
+  long long	rotate;
+  long		flush;
+  char		*end;
+
+  json = FALSE;
+  daily = FALSE;
+  rotate = 0;
+  flush = DEFAULT_EVENTS_FLUSH;
+  while (*cp) {
+    end = skip_until_space(cp);
+    if (end - cp == 4 && strncasecmp(cp, "json", 4) == 0) {
+      json = TRUE;
+    } else if (end - cp == 4 && strncasecmp(cp, "text", 4) == 0) {
+      json = FALSE;
+    } else if (end - cp == 5 && strncasecmp(cp, "daily", 5) == 0) {
+      daily = TRUE;
+    } else if (strncasecmp(cp, "rotate=", 7) == 0) {
+      rotate = strtoll(cp + 7, &cp, 10);
+      switch (tolower(*cp)) {
+      case 'g': rotate *= 1024;	/* FALLTHROUGH */
+      case 'm': rotate *= 1024;	/* FALLTHROUGH */
+      case 'k': rotate *= 1024;
+      }
+    } else if (strncasecmp(cp, "flush=", 6) == 0) {
+      flush = strtol(cp + 6, NULL, 10);
+    } else {
+      break;			/* the file name */
+    }
+    cp = skip_spaces(end);
+  }
+
+  if (rotate < 0 || flush < 1) {
+    fprintf(log_file, "! Bad events settings\n");
+    return;
+  }
+
+  /* Finish with the old file */
+  events_write();
+  events_close();
+  events_failed = FALSE;
+
+  free(events_file);
+  events_file = NULL;
+  if (*cp) {
+    events_file = strdup(cp);
+  }
+  events_json = json;
+  events_daily = daily;
+  events_rotate_size = rotate;
+  events_flush = flush;
+}
+
+
+/*
+ * Set where the history store is:
+ *	history file <file>
+ * With no file there's no history.
+ */
+static void
+set_history (char *cp) {
+
+  free(history_file);
+  history_file = NULL;
+  if (*cp) {
+    history_file = strdup(cp);
+    history_open();
+  } else {
+    history_close();
+  }
+}
+
+
+/*
+ * Set where the state journal is, restoring states from it:
+ *	journal <file>
+ * With no file there's no journal.
+ */
+static void
+set_journal (char *cp) {
+
+  free(journal_file);
+  journal_file = NULL;
+  if (*cp) {
+    journal_file = strdup(cp);
+    journal_open();
+  } else if (journal_fd != -1) {
+    close(journal_fd);
+    journal_fd = -1;
+  }
+}
+
+
+static void
+close_control (void) {
+
+  if (control_fd != -1) {
+    reactor_del(control_fd);
+    close(control_fd);
+    control_fd = -1;
+    unlink(control_path);
+  }
+}
+
+
+/*
+ * Set where the control socket is:
+ *	control <path>
+ * With no path there isn't one.  Clients already connected stay.
+ */
+static void
+set_control (char *cp) {
+  struct sockaddr_un	addr;
+
+  close_control();
+  free(control_path);
+  control_path = NULL;
+  if (*cp == '\0')
+    return;
+
+  if (strlen(cp) >= sizeof(addr.sun_path)) {
+    fprintf(log_file, "! Control socket path too long\n");
+    return;
+  }
+  control_path = strdup(cp);
+
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, control_path);
+  unlink(control_path);		/* left over from last time */
+
+  control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (control_fd == -1 ||
+      bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(control_fd, 16) == -1) {
+    fprintf(log_file, "! Can't listen on '%s' - errno=%d\n",
+	    control_path, errno);
+    if (control_fd != -1) {
+      close(control_fd);
+      control_fd = -1;
+    }
+    return;
+  }
+
+  reactor_add(control_fd, EPOLLIN);
+  fprintf(log_file, "Listening on '%s'\n", control_path);
+}
+
+
+/*
+ * Split an "exec" command up into its arguments at white space, once,
+ * when the trigger is added.  The argument list and the strings are
+ * one block.  Arguments with a '%' get a compiled template in
+ * "*atemplates"; the rest are used as they are.
+ */
+static char **
+tokenize_command (char *command, x10_template ***atemplates) {
+  char		**argv;
+  x10_template	**templates;
+  char		*cp, *end, *strings;
+  int		argc, i;
+
+  argc = 0;
+  for (cp = skip_spaces(command); *cp; cp = skip_spaces(cp)) {
+    cp = skip_until_space(cp);
+    argc++;
+  }
+  if (argc == 0)
+    return NULL;
+
+  argv = malloc((argc + 1) * sizeof(char *) + strlen(command) + 1);
+  templates = calloc(argc, sizeof(x10_template *));
+  if (!argv || !templates) {
+    free(argv);
+    free(templates);
+    return NULL;
+  }
+  strings = (char *)&argv[argc + 1];
+
+  i = 0;
+  for (cp = skip_spaces(command); *cp; cp = skip_spaces(end)) {
+    end = skip_until_space(cp);
+    argv[i] = strings;
+    memcpy(strings, cp, end - cp);
+    strings[end - cp] = '\0';
+    if (memchr(cp, '%', end - cp)) {
+      templates[i] = compile_template(strings, TRUE);
+    }
+    strings += end - cp + 1;
+    i++;
+  }
+  argv[argc] = NULL;
+
+  *atemplates = templates;
+  return argv;
+}
+
+
+/*
+ * Free a trigger's command and everything made from it.
+ */
+static void
+free_trigger_command (x10_trigger *trigger) {
+  int		i;
+
+  if (trigger->argv) {
+    for (i = 0; trigger->argv[i]; i++) {
+      free(trigger->argv_templates[i]);
+    }
+    free(trigger->argv_templates);
+    free(trigger->argv);
+  }
+  free(trigger->template);
+  free(trigger->command);
+  trigger->command = NULL;
+  trigger->template = NULL;
+  trigger->argv = NULL;
+  trigger->argv_templates = NULL;
+}
+
+
+/*
+ * Set a trigger's command, compiling it, and splitting it up if it's
+ * an "exec" one.  Shell commands only get substitutions for "all".  An
+ * "exec" with nothing to run is refused.
+ */
+static boolean
+set_trigger_command (x10_trigger *trigger, char *cp, boolean exec) {
+
+  trigger->command = NULL;
+  trigger->template = NULL;
+  trigger->argv = NULL;
+  trigger->argv_templates = NULL;
+  if (cp) {
+      trigger->command = malloc(strlen(cp)+1);
+      if (!trigger->command) {
+	  return FALSE;
+      }
+      strcpy(trigger->command, cp);
+      if (exec) {
+	  trigger->argv = tokenize_command(trigger->command,
+					   &trigger->argv_templates);
+	  if (!trigger->argv) {
+	      free(trigger->command);
+	      trigger->command = NULL;
+	      return FALSE;
+	  }
+      } else {
+	  trigger->template = compile_template(trigger->command,
+					       trigger->house == 0);
+	  if (!trigger->template) {
+	      free(trigger->command);
+	      trigger->command = NULL;
+	      return FALSE;
+	  }
+      }
+  }
+
+  return TRUE;
+}
+
+
+static x10_trigger *
+new_trigger (int house, int unit, func_value func, char *cp, boolean exec) {
+  x10_trigger	*trigger;
+
+  trigger = malloc(sizeof(*trigger));
+  if (!trigger)
+    return NULL;
+
+  trigger->house = house;
+  trigger->unit = unit;
+  trigger->function = func;
+  bzero(&trigger->opts, sizeof(trigger->opts));
+  trigger->tokens = 0;
+  trigger->refilled = 0;
+  trigger->limited = 0;
+  if (!set_trigger_command(trigger, cp, exec)) {
+      free(trigger);
+      return NULL;
+  }
+
+  return trigger;
+}
+
+
+static void
+insert_trigger(int house, int unit, func_value func, when_t when, char * cp,
+	       boolean exec) {
+  x10_trigger	*trigger;
+  
+  trigger = new_trigger(house, unit, func, cp, exec);
+  if (!trigger)
+    return;
+
+  /*
+   * Insert into linked list
+   */
+  trigger->next = trigger_list;
+  trigger_list = trigger;
+  trigger->when = when;
+  trigger->seq = ++trigger_seq;
+
+  index_trigger(trigger);
+}
+
+
+static void
+replace_trigger (x10_trigger *trigger, char *cmd, boolean exec) {
+
+    free_trigger_command(trigger);
+    
+    if (!cmd || (strlen(cmd) == 0) ||
+	!set_trigger_command(trigger, cmd, exec)) {
+	remove_trigger(trigger);	/* remove it instead */
+    }
+}
+
+
+/*
+ * Pick the options off the front of a trigger's command.  Returns
+ * what's left.
+ */
+static char *
+parse_trigger_options (char *cp, trigger_opts *opts) {
+  int		rate, per;
+
+  bzero(opts, sizeof(*opts));
+  while (cp) {
+    cp = skip_spaces(cp);
+    if (strncasecmp(cp, "remote", 6) == 0 &&
+	(cp[6] == '\0' || isspace(cp[6]))) {
+      opts->remote = TRUE;
+      cp += 6;
+    } else if (strncasecmp(cp, "rate=", 5) == 0 &&
+	       sscanf(cp + 5, "%d/%d", &rate, &per) == 2 &&
+	       rate > 0 && per > 0) {
+      opts->rate = rate;
+      opts->per = per;
+      cp = skip_until_space(cp);
+    } else {
+      break;
+    }
+  }
+
+  return cp;
+}
+
+
+/*
+ * The options as they'd be written before the command, with a trailing
+ * space if there are any.
+ */
+static char *
+format_trigger_options (x10_trigger *trigger) {
+  static char	buffer[64];
+
+  buffer[0] = '\0';
+  if (trigger->opts.remote) {
+    strcat(buffer, "remote ");
+  }
+  if (trigger->opts.per) {
+    sprintf(&buffer[strlen(buffer)], "rate=%d/%d ",
+	    trigger->opts.rate, trigger->opts.per);
+  }
+
+  return buffer;
+}
+
+
+/*
+ * Put a rule read while reloading on the staging list, with the same
+ * replace-or-remove rules as for the live ones.
+ */
+static void
+stage_trigger(int house, int unit, func_value func, when_t when, char *cp,
+	      boolean exec, trigger_opts *opts) {
+  reload_rule	**rp, *rule;
+
+  for (rp = &reload_rules; *rp; rp = &(*rp)->next) {
+    if ((*rp)->house == house && (*rp)->unit == unit &&
+	(*rp)->when == when && (when == NEVER || (*rp)->func == func))
+      break;
+  }
+
+  rule = *rp;
+  if (rule) {
+    free(rule->command);
+    if (!cp || !*cp) {		/* removes it */
+      *rp = rule->next;
+      free(rule);
+      return;
+    }
+  } else if (exec && (!cp || !*skip_spaces(cp))) {
+    fprintf(log_file, "! Nothing to exec for %c%d%s\n",
+	    house2name(house), unit, func2name(func));
+    return;
+  } else {
+    rule = malloc(sizeof(*rule));
+    if (!rule)
+      return;
+    rule->next = NULL;
+    *rp = rule;
+  }
+
+  rule->house = house;
+  rule->unit = unit;
+  rule->func = func;
+  rule->when = when;
+  rule->exec = exec;
+  rule->opts = *opts;
+  rule->command = cp ? strdup(cp) : NULL;
+}
+
+
+/*
+ * Add a trigger whose options have already been taken off "cp".
+ */
+static void
+add_trigger_opts(int house, int unit, func_value func, when_t when, char *cp,
+		 boolean exec, trigger_opts *opts) {
+  x10_trigger	*trigger;
+
+  if (house < 0 || house > 16 || unit < 0 || unit > 16) {
+    fprintf(log_file, "! Bad trigger unit %c%d\n", house2name(house), unit);
+    return;
+  }
+
+  if (reload_staging) {
+    stage_trigger(house, unit, func, when, cp, exec, opts);
+    return;
+  }
+
+  config_changed();
+  trigger = find_trigger(house, unit, func, when);
+  if (!trigger && exec && (!cp || !*skip_spaces(cp))) {
+    fprintf(log_file, "! Nothing to exec for %c%d%s\n",
+	    house2name(house), unit, func2name(func));
+    return;
+  }
+  if (!trigger) {
+    fprintf(log_file, "New ");
+    insert_trigger(house, unit, func, when, cp, exec);
+  } else {
+    fprintf(log_file, "Replace ");
+    replace_trigger(trigger, cp, exec);
+  }
+  trigger = find_trigger(house, unit, func, when);
+  if (trigger && trigger->house == house && trigger->unit == unit &&
+      trigger->function == func && trigger->when == when) {
+    trigger->opts = *opts;
+    trigger->tokens = opts->rate;	/* start with a full bucket */
+    trigger->refilled = now_msecs();
+  }
+  if (house == 0) {
+    fprintf(log_file, "Trigger all: %s\n", cp);
+  } else {
+    fprintf(log_file, "Trigger: %c%d%s: %s\n",
+	    house2name(house), unit, func2name(func), cp);
+  }
+  fflush(log_file);
+
+}
+
+
+static void
+add_trigger(int house, int unit, func_value func, when_t when, char * cp,
+	    boolean exec) {
+  trigger_opts	opts;
+
+  cp = parse_trigger_options(cp, &opts);
+  add_trigger_opts(house, unit, func, when, cp, exec, &opts);
+}
+
+
+static void
+print_triggers (FILE *file) {
+  x10_trigger	*trigger;
+  char		*opts;
+
+  for (trigger = trigger_list ; trigger ; trigger = trigger->next) {
+    opts = format_trigger_options(trigger);
+    //    if (trigger->function == no_function) {
+    if (trigger->argv) {
+      if (trigger->house == 0 && trigger->unit == 0) {
+	fprintf(file, "exec all %s%s\n", opts, trigger->command);
+      } else {
+	fprintf(file, "exec %c%02d %-4s %s%s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function), opts, trigger->command);
+      }
+    } else if (trigger->house == 0 && trigger->unit == 0) {
+      if (trigger->when == ALWAYS) {
+	fprintf(file, "always all %s%s\n", opts, trigger->command);
+      } else if (trigger->when == NEVER) {
+	fprintf(file, "never all %s%s\n", opts, trigger->command);
+      } else {
+	fprintf(file, "trigger all %s%s\n", opts, trigger->command);
+      }
+    } else if (!trigger->command) {
+      if (trigger->when == ALWAYS) {
+	fprintf(file, "reset %c%02d %-4s %s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function), opts);
+      }	else if (trigger->when == NEVER) {
+	fprintf(file, "never %c%02d %-4s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function));
+      } else {
+	fprintf(file, "trigger %c%02d %-4s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function));
+      }
+    } else {
+      if (trigger->when == ALWAYS) {
+	fprintf(file, "always %c%02d %-4s %s%s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function), opts, trigger->command);
+      } else if (trigger->when == NEVER) {
+	fprintf(file, "never %c%02d %-4s %s%s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function), opts, trigger->command);
+      } else {
+	fprintf(file, "trigger %c%02d %-4s %s%s\n",
+		house2name(trigger->house), trigger->unit,
+		func2name(trigger->function), opts, trigger->command);
+      }
+    }
+  }
+  fflush(file);
+}
+
+
+static void
+upcase_word (char *cptr) {
+  char	*cp;
+
+  for (cp = cptr ; *cp && !isspace(*cp) ; cp++)
+    if (islower(*cp))
+      *cp = toupper(*cp);
+}
+
+
+/*
+ * Write out everything needed to get back to where we are, as
+ * commands.  A file is written under a temporary name, synced and
+ * renamed into place, so there's always a complete one.
+ */
+static boolean
+dump_state (char *output_file) {
+  FILE		*file;
+  boolean	got_file, ok;
+  int		h, u;
+  char		temp[1024];
+  
+  got_file = FALSE;
+  if (output_file && *output_file) {
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", output_file, (int)getpid());
+    file = fopen(temp, "w");
+    if (file) {
+      got_file = TRUE;
+    } else {
+      fprintf(log_file, "! Error creating '%s' - errno=%d\n", temp, errno);
+    }
+  }
+
+  /*
+   * If no output avail., use log_file
+   */
+  if (!got_file) {
+    file = log_file;
+  }
+
+  /*
+   * Print any device -> descriptions we know
+   */
+  print_descs(file);
+
+  /*
+   * Dump all device states
+   */
+//  print_status(file, NULL, FALSE);
+
+  /*
+   * Now, dump all triggers
+   */
+  print_triggers(file);
+
+  /*
+   * How we poll the buffer
+   */
+  fprintf(file, "poll %ld %ld %g %ld\n",
+	  poll_min, poll_max, poll_decay, poll_burst);
+  fprintf(file, "window %d %ld %d\n", xact_window, xact_timeout, xact_tries);
+  fprintf(file, "verify %ld %d\n", verify_timeout, verify_retries);
+  fprintf(file, "pace %ld\n", pace);
+  fprintf(file, "suppress %d\n", suppress_window);
+  fprintf(file, "debounce %ld\n", debounce_default);
+  for (h = 1; h <= 16; h++) {
+    for (u = 1; u <= 16; u++) {
+      if (debounce_msecs[h][u]) {
+	fprintf(file, "debounce %c%02d %ld\n", house2name(h), u,
+		debounce_msecs[h][u]);
+      }
+    }
+  }
+  fprintf(file, "jobs %d\n", max_jobs);
+  if (coproc_command) {
+    fprintf(file, "coprocess %s\n", coproc_command);
+  }
+
+  /*
+   * Any "events" command we have
+   */
+  if (events_file != NULL) {
+    fprintf(file, "events %s%s", events_json ? "json " : "",
+	    events_daily ? "daily " : "");
+    if (events_rotate_size) {
+      fprintf(file, "rotate=%lld ", (long long)events_rotate_size);
+    }
+    if (events_flush != DEFAULT_EVENTS_FLUSH) {
+      fprintf(file, "flush=%ld ", events_flush);
+    }
+    fprintf(file, "%s\n", events_file);
+  }
+
+  if (history_file != NULL) {
+    fprintf(file, "history file %s\n", history_file);
+  }
+  if (journal_file != NULL) {
+    fprintf(file, "journal %s\n", journal_file);
+  }
+  if (control_path != NULL) {
+    fprintf(file, "control %s\n", control_path);
+  }
+
+  /*
+   * And our "commands" command
+   */
+  if (command_file != NULL) {
+    fprintf(file, "commands %s\n", command_file);
+  }
+
+  ok = (fflush(file) == 0);
+  if (!got_file)
+    return ok;
+
+  ok = ok && fsync(fileno(file)) == 0;
+  ok = (fclose(file) == 0) && ok;
+  if (ok && rename(temp, output_file) == 0)
+    return TRUE;
+
+  fprintf(log_file, "! Error writing '%s' - errno=%d\n", output_file, errno);
+  unlink(temp);
+  return FALSE;
+}
+
+
+/*
+ * Save the commands file from a child process.  If one's already at
+ * it, go again when it's done.
+ */
+static void
+save_start (void) {
+
+  if (!command_file)
+    return;
+  if (save_pid > 0) {
+    save_again = TRUE;
+    return;
+  }
+
+  fflush(log_file);
+  save_pid = fork();
+  if (save_pid == 0) {
+    _exit(dump_state(command_file) ? 0 : 1);
+  } else if (save_pid < 0) {
+    fprintf(log_file, "! Can't fork to save - errno=%d\n", errno);
+    save_pid = 0;
+    if (dump_state(command_file)) {
+      saves++;
+      reload_note_file();
+    } else {
+      saves_failed++;
+    }
+  }
+}
+
+
+static void
+save_exited (int status) {
+
+  save_pid = 0;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    saves++;
+    reload_note_file();
+  } else {
+    saves_failed++;
+  }
+
+  if (save_again) {
+    save_again = FALSE;
+    save_start();
+  }
+}
+
+
+static void
+dump_and_exit (int signum) {
+
+  if (save_pid > 0) {
+    (void)waitpid(save_pid, NULL, 0);	/* let it finish first */
+  }
+  dump_state(command_file);
+  events_write();
+  events_close();
+  history_close();
+  close_control();
+  fclose(log_file);
+
+  exit(0);
+}
+
+
+/*
+ * Pick up whatever signals have arrived on the signalfd.
+ */
+static void
+read_signals (void) {
+  struct signalfd_siginfo	info;
+
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+    case SIGHUP:
+      fprintf(log_file, "Caught signal %d\n", info.ssi_signo);
+      events_reopen();
+      break;
+
+    case SIGINT:
+    case SIGQUIT:
+    case SIGTERM:
+      fprintf(log_file, "Caught signal %d\n", info.ssi_signo);
+      dump_and_exit(info.ssi_signo);
+      break;
+
+    case SIGCHLD:
+      reap_jobs();
+      break;
+    }
+  }
+}
+
+
+/*
+ * Reset everything to the current known state
+ */
+static void
+reset_state(void) {
+  int		i, j;
+
+  for (i = 1 ; i <= 16 ; i++) {
+    for (j = 1 ; j <= 16 ; j++) {
+      if (states[i][j] == state_on || states[i][j] == state_off) {
+	queue_x10_command(i, j, state2func(states[i][j]), PRI_SWEEP);
+      }
+    }
+  }
+  send_x10_commands();
+}
+
+
+/*
+ * Does this line start with a device address ("A1", "a 12") rather
+ * than a keyword?
+ */
+static boolean
+is_device_command (char *cp) {
+
+  if (!((*cp >= 'A' && *cp <= 'P') || (*cp >= 'a' && *cp <= 'p')))
+    return FALSE;
+
+  return isdigit(*skip_spaces(cp + 1));
+}
+
+
+static void
+parse_device_command (char *buffer) {
+  char		*cp;
+  char		house;
+  int		unit;
+  char		houses[MAX_PENDING_CMDS];
+  int		units[MAX_PENDING_CMDS];
+  int		naddrs;
+  boolean	new_list;
+  state_value	state;
+  func_value	func;
+  boolean	force;
+  int		i;
+
+  house = '@';			/* no house or unit yet */
+  unit = 0;
+  naddrs = 0;
+  new_list = TRUE;
+
+  /*
+   * Just upcase everything now
+   *
+   * All commands after this point can be converted to total CAPS
+   */
+  for (cp = buffer ; *cp ; cp++)
+    if (islower(*cp))
+      *cp = toupper(*cp);
+
+  force = (strstr(buffer, "FORCE") != NULL);
+
+  for (cp = buffer ; *cp ; cp++) {
+    if (*cp == ' ')
+      continue;
+
+    if (strncmp(cp, "FORCE", 5) == 0) {
+      cp += 4;			/* all except last char */
+    } else if (strncmp(cp, "UND", 3) == 0) {
+      for (i = 0; i < naddrs; i++) {
+	states[(int)houses[i]][units[i]] = undefined;
+	journal_state(houses[i], units[i], undefined);
+      }
+      new_list = TRUE;
+      cp += 2;			/* all except last char */
+    } else if ((func = parse_ti103_function(&state, &cp)) != no_function) {
+      if (naddrs == 0) {
+	/* function with no address, send it to whatever we have */
+	houses[0] = name2house(house);
+	units[0] = unit;
+	naddrs = 1;
+      }
+      for (i = 0; i < naddrs; i++) {
+	if (!force && command_redundant(houses[i], units[i], func)) {
+	  fprintf(log_file, "Skipping %c%d %s - already %s\n",
+		  house2name(houses[i]), units[i], func2name(func),
+		  state2name(states[(int)houses[i]][units[i]]));
+	  suppressed++;
+	  continue;
+	}
+	queue_x10_command(houses[i], units[i], func, PRI_INTERACTIVE);
+      }
+      new_list = TRUE;
+      cp--;			/* adjust for incr. in loop */
+    } else if (*cp >= 'A' && *cp <= 'P') {
+      house = *cp;
+      continue;
+    } else if (isdigit(*cp)) {
+      unit = atoi(cp);
+      if (unit > 16) {
+	fprintf(log_file, "! Bad unit number %d\n", unit);
+	unit = 0;
+      } else if (house != '@' && naddrs < MAX_PENDING_CMDS) {
+	if (new_list) {
+	  naddrs = 0;
+	  new_list = FALSE;
+	}
+	houses[naddrs] = name2house(house);
+	units[naddrs] = unit;
+	naddrs++;
+      }
+      cp = skip_digits(cp);
+      cp--;			/* adjust for incr. in loop */
+    }
+  }
+
+  send_x10_commands();
+}
+
+
+static void
+parse_stdin (char *buffer) {
+  char		*cp;
+  char		house;
+  int		unit;
+  state_value	state;
+  func_value	func;
+  trigger_opts	opts;
+  
+  cp = buffer;
+  house = '@';			/* no house or unit yet */
+  unit = 0;
+
+  cp = skip_spaces(cp);
+  if (is_device_command(cp)) {
+    parse_device_command(buffer);
+    return;
+  }
+
+  upcase_word(cp);
+  if (strncmp(cp, "DEBOUNCE", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_debounce(cp);
+    return;
+  } else if (strncmp(cp, "DESCRIPTION", 2) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    if (parse_house_unit(&cp, &house, &unit)) {
+      /* description is rest of line */
+      cp = skip_spaces(cp);
+      add_desc(house, unit, cp);
+      return;
+    }
+  } else if (strncmp(cp, "TRIGGER", 1) == 0) {
+    /* Skip keyword - read house/unit */
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    upcase_word(cp);
+    if (strncmp(cp, "ALL", 2) == 0) {
+      cp = skip_until_space(cp);
+      cp = skip_spaces(cp);
+      add_trigger(0, 0, no_function, TRANSITION, cp, FALSE);
+      return;
+    } else if (parse_house_unit(&cp, &house, &unit)) {
+	cp = skip_spaces(cp);
+
+	upcase_word(cp);
+	func = parse_ti103_function(&state, &cp);
+	cp = skip_spaces(cp);
+
+	/* command is the rest of the line */
+	add_trigger(house, unit, func, TRANSITION, cp, FALSE);
+	return;
+    }
+  } else if (strncmp(cp, "EXEC", 4) == 0) {
+    /* Like "trigger", but the command is run without a shell */
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    upcase_word(cp);
+    if (strncmp(cp, "ALL", 2) == 0) {
+      cp = skip_until_space(cp);
+      cp = skip_spaces(cp);
+      add_trigger(0, 0, no_function, TRANSITION, cp, TRUE);
+      return;
+    } else if (parse_house_unit(&cp, &house, &unit)) {
+	cp = skip_spaces(cp);
+
+	upcase_word(cp);
+	func = parse_ti103_function(&state, &cp);
+	cp = skip_spaces(cp);
+
+	/* command is the rest of the line */
+	add_trigger(house, unit, func, TRANSITION, cp, TRUE);
+	return;
+    }
+  } else if (strncmp(cp, "ALWAYS", 1) == 0) {
+    fprintf(log_file, "Read always\n");
+    /* Skip keyword - read house/unit */
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    upcase_word(cp);
+    if (strncmp(cp, "ALL", 2) == 0) {
+      fprintf(log_file, "Read always all\n");
+      cp = skip_until_space(cp);
+      cp = skip_spaces(cp);
+      add_trigger(0, 0, no_function, ALWAYS, cp, FALSE);
+      return;
+    } else if (parse_house_unit(&cp, &house, &unit)) {
+      fprintf(log_file, "Read always house/unit\n");
+	cp = skip_spaces(cp);
+
+	upcase_word(cp);
+	func = parse_ti103_function(&state, &cp);
+	cp = skip_spaces(cp);
+
+	/* command is the rest of the line */
+	add_trigger(house, unit, func, ALWAYS, cp, FALSE);
+	return;
+    }
+  } if (strncmp(cp, "NEVER", 1) == 0) {
+    fprintf(log_file, "Read never\n");
+    /* Skip keyword - read house/unit */
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    upcase_word(cp);
+    if (strncmp(cp, "ALL", 2) == 0) {
+      fprintf(log_file, "Read never all\n");
+      cp = skip_until_space(cp);
+      cp = skip_spaces(cp);
+      add_trigger(0, 0, no_function, NEVER, cp, FALSE);
+      return;
+    } else if (parse_house_unit(&cp, &house, &unit)) {
+      fprintf(log_file, "Read never house/unit\n");
+	cp = skip_spaces(cp);
+	upcase_word(cp);
+	func = parse_ti103_function(&state, &cp);
+	cp = skip_spaces(cp);
+
+	/* command is the rest of the line */
+	add_trigger(house, unit, func, NEVER, cp, FALSE);
+	return;
+    }
+  } else if (strncmp(cp, "RESET", 3) == 0) {
+    /* Skip keyword - read house/unit */
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    upcase_word(cp);
+    if (parse_house_unit(&cp, &house, &unit)) {
+	cp = skip_spaces(cp);
+
+	upcase_word(cp);
+	func = parse_ti103_function(&state, &cp);
+	cp = skip_spaces(cp);
+
+	/* only options on the rest of the line */
+	(void)parse_trigger_options(cp, &opts);
+	add_trigger_opts(house, unit, func, ALWAYS, NULL, FALSE, &opts);
+	return;
+    }
+  } else if (strncmp(cp, "DUMP", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    dump_state(cp);
+    ti103_cmd_print();
+    return;
+  } else if (strncmp(cp, "STATUS", 6) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    print_status(NULL, cp, TRUE);
+    return;
+  } else if (strncmp(cp, "HISTORY", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    if (strncasecmp(cp, "file", 4) == 0 && (cp[4] == '\0' || isspace(cp[4]))) {
+      cp = skip_until_space(cp);
+      cp = skip_spaces(cp);
+      set_history(cp);
+    } else {
+      print_history(NULL, cp);
+    }
+    return;
+  } else if (strncmp(cp, "CONTROL", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_control(cp);
+    return;
+  } else if (strncmp(cp, "JOURNAL", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_journal(cp);
+    return;
+  } else if (strncmp(cp, "STATS", 5) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    print_stats(cp);
+    return;
+  } else if (strncmp(cp, "COPROCESS", 6) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_coproc(cp);
+    return;
+  } else if (strncmp(cp, "JOBS", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_max_jobs(cp);
+    return;
+  } else if (strncmp(cp, "SUPPRESS", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_suppress(cp);
+    return;
+  } else if (strncmp(cp, "PACE", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_pace(cp);
+    return;
+  } else if (strncmp(cp, "VERIFY", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_verify(cp);
+    return;
+  } else if (strncmp(cp, "WINDOW", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_window(cp);
+    return;
+  } else if (strncmp(cp, "POLL", 4) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_poll(cp);
+    return;
+  } else if (strncmp(cp, "COMMANDS", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    if (*cp == '\0') {
+      free(command_file);
+      command_file = NULL;
+    } else {
+      command_file = strdup(cp);
+    }
+    if (inotify_fd != -1) {
+      reload_watch();
+    }
+    return;
+  } else if (strncmp(cp, "EVENTS", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    set_events(cp);
+    return;
+  } else if (strncmp(cp, "REINIT", 3) == 0) {
+    cp = skip_until_space(cp);
+    cp = skip_spaces(cp);
+    reset_state();
+    return;
+  }
+
+  parse_device_command(buffer);
+}
+
+
+
+/*
+ * Read commands from stdin.  stdin is non-blocking and edge triggered,
+ * so keep reading until there's nothing left, handing each complete
+ * line to parse_stdin().
+ */
+static void
+read_stdin (void) {
+  static char	buffer[CONTROL_LINE_SIZE];
+  static int	buflen = 0;
+  char		*nl;
+  int		ret;
+  int		linelen;
+  boolean	eof;
+
+  while (TRUE) {
+    ret = read(STDIN_FILENO, &buffer[buflen], sizeof(buffer) - 1 - buflen);
+    if (ret < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return;			/* EAGAIN - drained */
+    }
+    eof = (ret == 0);
+    buflen += ret;
+
+    while (buflen > 0) {
+      nl = memchr(buffer, '\n', buflen);
+      if (nl) {
+	*nl = '\0';		/* Remove the '\n' from the end */
+	linelen = nl - buffer + 1;
+      } else if (eof || buflen == sizeof(buffer) - 1) {
+	buffer[buflen] = '\0';	/* take what we have */
+	linelen = buflen;
+      } else {
+	break;			/* wait for the rest of the line */
+      }
+
+      fprintf(log_file, "Read command: '%s'\n", buffer);
+      fflush(log_file);
+
+      parse_stdin(buffer);
+
+      buflen -= linelen;
+      memmove(buffer, &buffer[linelen], buflen);
+    }
+
+    if (eof) {
+      fprintf(log_file, "Pipe input ended\n");
+      return;
+    }
+  }
+}
+
+
+static void
+control_accept (void) {
+  control_client	*client;
+  int			fd;
+
+  while ((fd = accept(control_fd, NULL, NULL)) != -1) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (control_nclients >= MAX_CONTROL_CLIENTS) {
+      fprintf(log_file, "! Too many control clients\n");
+      close(fd);
+      continue;
+    }
+
+    client = calloc(1, sizeof(*client));
+    if (!client) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->events = EPOLLIN;
+    if (!reactor_add(fd, client->events)) {
+      close(fd);
+      free(client);
+      continue;
+    }
+    client->next = control_clients;
+    control_clients = client;
+    control_nclients++;
+    control_accepted++;
+  }
+}
+
+
+static control_client *
+control_find (int fd) {
+  control_client	*client;
+
+  for (client = control_clients; client; client = client->next) {
+    if (client->fd == fd)
+      return client;
+  }
+  return NULL;
+}
+
+
+static void
+control_close (control_client *client) {
+  control_client	**cp;
+
+  for (cp = &control_clients; *cp; cp = &(*cp)->next) {
+    if (*cp == client) {
+      *cp = client->next;
+      break;
+    }
+  }
+  reactor_del(client->fd);
+  close(client->fd);
+  free(client->tx);
+  free(client);
+  control_nclients--;
+}
+
+
+/*
+ * Queue reply bytes for a client.
+ */
+static void
+control_send (control_client *client, const char *data, size_t len) {
+  char		*tx;
+  size_t	size;
+
+  if (client->tx_head + client->tx_len + len > client->tx_size) {
+    memmove(client->tx, &client->tx[client->tx_head], client->tx_len);
+    client->tx_head = 0;
+  }
+  if (client->tx_len + len > client->tx_size) {
+    size = client->tx_size ? client->tx_size : 4096;
+    while (size < client->tx_len + len) {
+      size *= 2;
+    }
+    tx = realloc(client->tx, size);
+    if (!tx)
+      return;
+    client->tx = tx;
+    client->tx_size = size;
+  }
+  memcpy(&client->tx[client->tx_head + client->tx_len], data, len);
+  client->tx_len += len;
+}
+
+
+/*
+ * Write out as much of a client's replies as it will take.  Returns
+ * FALSE if it's gone.
+ */
+static boolean
+control_flush (control_client *client) {
+  ssize_t	ret;
+
+  while (client->tx_len > 0) {
+    ret = write(client->fd, &client->tx[client->tx_head], client->tx_len);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      return (errno == EAGAIN);
+    }
+    client->tx_head += ret;
+    client->tx_len -= ret;
+  }
+  client->tx_head = 0;
+  return TRUE;
+}
+
+
+/*
+ * Run a client's command with the log going to a memory stream, then
+ * copy what it wrote to the real log and queue it as the reply.
+ */
+static void
+control_command (control_client *client, char *line) {
+  FILE		*out, *saved;
+  char		*reply, *cp, *nl;
+  size_t	size;
+
+  fprintf(log_file, "Control command: '%s'\n", line);
+  control_commands++;
+
+  reply = NULL;
+  out = open_memstream(&reply, &size);
+  if (!out) {
+    parse_stdin(line);
+    control_send(client, ".\n", 2);
+    return;
+  }
+
+  saved = log_file;
+  log_file = out;
+  parse_stdin(line);
+  log_file = saved;
+  fclose(out);
+  fwrite(reply, 1, size, log_file);
+
+  for (cp = reply; cp < reply + size; cp = nl + 1) {
+    nl = memchr(cp, '\n', reply + size - cp);
+    if (!nl) {
+      nl = reply + size;	/* no newline on the end */
+    }
+    if (*cp == '.') {
+      control_send(client, ".", 1);
+    }
+    control_send(client, cp, nl - cp);
+    control_send(client, "\n", 1);
+  }
+  control_send(client, ".\n", 2);
+  free(reply);
+}
+
+
+/*
+ * Read what a client has sent and run any whole lines.  Returns FALSE
+ * if it's gone.
+ */
+static boolean
+control_read (control_client *client) {
+  char		*nl;
+  int		ret;
+  int		linelen;
+
+  ret = read(client->fd, &client->rx[client->rx_len],
+	     sizeof(client->rx) - 1 - client->rx_len);
+  if (ret < 0) {
+    return (errno == EINTR || errno == EAGAIN);
+  }
+  if (ret == 0) {
+    return FALSE;
+  }
+  client->rx_len += ret;
+
+  while (client->rx_len > 0) {
+    nl = memchr(client->rx, '\n', client->rx_len);
+    if (nl) {
+      *nl = '\0';
+      if (nl > client->rx && nl[-1] == '\r') {
+	nl[-1] = '\0';
+      }
+      linelen = nl - client->rx + 1;
+    } else if (client->rx_len == sizeof(client->rx) - 1) {
+      client->rx[client->rx_len] = '\0';	/* take what we have */
+      linelen = client->rx_len;
+    } else {
+      break;			/* wait for the rest of the line */
+    }
+
+    control_command(client, client->rx);
+
+    client->rx_len -= linelen;
+    memmove(client->rx, &client->rx[linelen], client->rx_len);
+  }
+
+  return TRUE;
+}
+
+
+/*
+ * Something happened on a client's connection.  Stop reading from it
+ * while it has a lot of replies it hasn't taken.
+ */
+static void
+control_io (control_client *client, uint32_t events) {
+  uint32_t	want;
+
+  if ((events & EPOLLIN) && !control_read(client)) {
+    control_close(client);
+    return;
+  }
+  if ((events & (EPOLLHUP | EPOLLERR)) && !(events & EPOLLIN)) {
+    control_close(client);
+    return;
+  }
+  if (!control_flush(client)) {
+    control_close(client);
+    return;
+  }
+
+  want = (client->tx_len < CONTROL_TX_HIGH ? EPOLLIN : 0) |
+	 (client->tx_len > 0 ? EPOLLOUT : 0);
+  if (want != client->events) {
+    reactor_mod(client->fd, want);
+    client->events = want;
+  }
+}
+
+
+static void
+read_commands (char *com_file) {
+  FILE		*com;
+  char		*buffer;
+  size_t	size;
+  ssize_t	buflen;
+
+  com = fopen(com_file, "r");
+  if (!com) {
+    return;
+  }
+  save_loading = TRUE;
+
+  buffer = NULL;
+  size = 0;
+  while ((buflen = getline(&buffer, &size, com)) > 0) {
+    /* Remove the '\n' from the end */
+    if (buffer[buflen-1] == '\n') {
+      buffer[buflen-1] = '\0';
+    }
+    
+    fprintf(log_file, "Read command from file : '%s'\n", buffer);
+    fflush(log_file);
+    
+    parse_stdin(buffer);
+  }
+  free(buffer);
 
-  exit(0);
+  fclose(com);
+  save_loading = FALSE;
 }
 
 
 /*
- * Reset everything to the current known state
+ * The commands file to watch - the one we save to if there is one,
+ * or else the one we started with.
  */
-static void parse_stdin(char *buffer);
+static char *
+reload_path (void) {
 
+  return command_file ? command_file : commands_read;
+}
+
+
+/*
+ * Remember the version of the file we have, so seeing it again - our
+ * own save, say - doesn't reload it.
+ */
 static void
-reset_state(void) {
-  int		i, j;
-  char		buffer[80];
+reload_note_file (void) {
 
-  for (i = 1 ; i <= 16 ; i++) {
-    for (j = 1 ; j <= 16 ; j++) {
-      if (states[i][j] != undefined) {
-	sprintf(buffer, "%c %d %-4s\n",
-		  house2name(i), j,
-		  state2name(states[i][j]));
-	parse_stdin(buffer);
-      }
-    }
+  if (!reload_path() || stat(reload_path(), &reload_known) == -1) {
+    bzero(&reload_known, sizeof(reload_known));
   }
 }
 
 
 static void
-parse_stdin (char *buffer) {
-  char		*cp;
-  char		house;
-  int		unit;
-  state_value	state;
-  func_value	func;
-  
-  cp = buffer;
+reload_watch (void) {
+  char		dir[1024];
+  char		*slash;
 
-  cp = skip_spaces(cp);
-  upcase_word(cp);
-  if (strncmp(cp, "DESCRIPTION", 2) == 0) {
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    if (parse_house_unit(&cp, &house, &unit)) {
-      /* description is rest of line */
-      cp = skip_spaces(cp);
-      add_desc(house, unit, cp);
+  if (!reload_path())
+    return;
+
+  if (inotify_fd == -1) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+      fprintf(log_file, "! Can't watch commands file - errno=%d\n", errno);
       return;
     }
-  } else if (strncmp(cp, "TRIGGER", 1) == 0) {
-    /* Skip keyword - read house/unit */
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    upcase_word(cp);
-    if (strncmp(cp, "ALL", 2) == 0) {
-      cp = skip_until_space(cp);
-      cp = skip_spaces(cp);
-      add_trigger(0, 0, no_function, TRANSITION, cp);
-      return;
-    } else if (parse_house_unit(&cp, &house, &unit)) {
-	cp = skip_spaces(cp);
+    reactor_add(inotify_fd, EPOLLIN);
+  }
 
-	upcase_word(cp);
-	func = parse_ti103_function(&state, &cp);
-	cp = skip_spaces(cp);
+  if (reload_wd != -1) {
+    inotify_rm_watch(inotify_fd, reload_wd);
+  }
+  snprintf(dir, sizeof(dir), "%s", reload_path());
+  slash = strrchr(dir, '/');
+  if (!slash) {
+    strcpy(dir, ".");
+  } else if (slash == dir) {
+    dir[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  reload_wd = inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (reload_wd == -1) {
+    fprintf(log_file, "! Can't watch '%s' - errno=%d\n", dir, errno);
+  }
+  reload_note_file();
+}
 
-	/* command is the rest of the line */
-	add_trigger(house, unit, func, TRANSITION, cp);
-	return;
-    }
-  } else if (strncmp(cp, "ALWAYS", 1) == 0) {
-    fprintf(log_file, "Read always\n");
-    /* Skip keyword - read house/unit */
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    upcase_word(cp);
-    if (strncmp(cp, "ALL", 2) == 0) {
-      fprintf(log_file, "Read always all\n");
-      cp = skip_until_space(cp);
-      cp = skip_spaces(cp);
-      add_trigger(0, 0, no_function, ALWAYS, cp);
-      return;
-    } else if (parse_house_unit(&cp, &house, &unit)) {
-      fprintf(log_file, "Read always house/unit\n");
-	cp = skip_spaces(cp);
 
-	upcase_word(cp);
-	func = parse_ti103_function(&state, &cp);
-	cp = skip_spaces(cp);
+/*
+ * Something in the directory changed.  If it's the commands file,
+ * read it once things have settled.
+ */
+static void
+reload_events (void) {
+  char			buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event	*ev;
+  char			*name, *slash;
+  ssize_t		len;
+  char			*p;
+
+  name = reload_path();
+  if (name && (slash = strrchr(name, '/')) != NULL) {
+    name = slash + 1;
+  }
 
-	/* command is the rest of the line */
-	add_trigger(house, unit, func, ALWAYS, cp);
-	return;
+  while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (p = buffer; p < buffer + len;
+	 p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)p;
+      if (name && ev->len && strcmp(ev->name, name) == 0) {
+	arm_timer(reload_timer_fd, RELOAD_DELAY, FALSE);
+      }
     }
-  } if (strncmp(cp, "NEVER", 1) == 0) {
-    fprintf(log_file, "Read never\n");
-    /* Skip keyword - read house/unit */
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    upcase_word(cp);
-    if (strncmp(cp, "ALL", 2) == 0) {
-      fprintf(log_file, "Read never all\n");
-      cp = skip_until_space(cp);
-      cp = skip_spaces(cp);
-      add_trigger(0, 0, no_function, NEVER, cp);
-      return;
-    } else if (parse_house_unit(&cp, &house, &unit)) {
-      fprintf(log_file, "Read never house/unit\n");
-	cp = skip_spaces(cp);
-	upcase_word(cp);
-	func = parse_ti103_function(&state, &cp);
-	cp = skip_spaces(cp);
+  }
+}
 
-	/* command is the rest of the line */
-	add_trigger(house, unit, func, NEVER, cp);
-	return;
-    }
-  } else if (strncmp(cp, "RESET", 3) == 0) {
-    /* Skip keyword - read house/unit */
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    upcase_word(cp);
-    if (parse_house_unit(&cp, &house, &unit)) {
-	cp = skip_spaces(cp);
 
-	upcase_word(cp);
-	func = parse_ti103_function(&state, &cp);
-	cp = skip_spaces(cp);
+/*
+ * Lines in the commands file that are rules - the ones parse_stdin()
+ * hands to add_trigger() or add_desc().
+ */
+static boolean
+is_rule_command (char *cp) {
+  char		word[16];
+  size_t	i;
 
-	/* command is the rest of the line */
-	add_trigger(house, unit, func, ALWAYS, NULL);
-	return;
-    }
-  } else if (strncmp(cp, "DUMP", 4) == 0) {
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    dump_state(cp);
-    ti103_cmd_print();
-    return;
-  } else if (strncmp(cp, "STATUS", 6) == 0) {
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    print_status(NULL, cp, TRUE);
-    return;
-  } else if (strncmp(cp, "COMMANDS", 3) == 0) {
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    if (*cp == '\0') {
-      free(command_file);
-      command_file = NULL;
-    } else {
-      command_file = strdup(cp);
-    }
-    return;
-  } else if (strncmp(cp, "EVENTS", 3) == 0) {
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    if (*cp == '\0') {
-      free(events_file);
-      events_file = NULL;
-    } else {
-      events_file = strdup(cp);
-    }
-    return;
-  } else if (strncmp(cp, "REINIT", 3) == 0) {
-    cp = skip_until_space(cp);
-    cp = skip_spaces(cp);
-    reset_state();
-    return;
+  cp = skip_spaces(cp);
+  if (is_device_command(cp))
+    return FALSE;
+
+  for (i = 0; i < sizeof(word) - 1 && cp[i] && !isspace(cp[i]); i++) {
+    word[i] = toupper(cp[i]);
   }
+  word[i] = '\0';
 
-  /*
-   * Just upcase everything now
-   *
-   * All commands after this point can be converted to total CAPS
-   */
-  for (cp = buffer ; *cp ; cp++)
-    if (islower(*cp))
-      *cp = toupper(*cp);
+  if (strncmp(word, "DEBOUNCE", 3) == 0)
+    return FALSE;
+  return (strncmp(word, "DESCRIPTION", 2) == 0 ||
+	  strncmp(word, "TRIGGER", 1) == 0 ||
+	  strncmp(word, "EXEC", 4) == 0 ||
+	  strncmp(word, "ALWAYS", 1) == 0 ||
+	  strncmp(word, "NEVER", 1) == 0 ||
+	  strncmp(word, "RESET", 3) == 0);
+}
 
-  for (cp = buffer ; *cp ; cp++) {
-    if (*cp == ' ')
-      continue;
 
-    if (strncmp(cp, "ON", 2) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, on, NONE);
-	  (void)all_trigger(name2house(house), unit, on);
-      }
-      write_ti103_command(name2house(house), unit, on);
-      cp += 1;			/* all except last char */
-    } else if (strncmp(cp, "OFF", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, off, NONE);
-	  (void)all_trigger(name2house(house), unit, off);
-      }
-      write_ti103_command(name2house(house), unit, off);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "HAK", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, hail_ack, NONE);
-	  (void)all_trigger(name2house(house), unit, hail_ack);
-      }
-      write_ti103_command(name2house(house), unit, hail_ack);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "HRQ", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, hail_request, NONE);
-	  (void)all_trigger(name2house(house), unit, hail_request);
-      }
-      write_ti103_command(name2house(house), unit, hail_request);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "SRQ", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, status_request, NONE);
-	  (void)all_trigger(name2house(house), unit, status_request);
-      }
-      write_ti103_command(name2house(house), unit, status_request);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "DIM", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, dim, NONE);
-	  (void)all_trigger(name2house(house), unit, dim);
-      }
-      write_ti103_command(name2house(house), unit, dim);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "BGT", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, bright, NONE);
-	  (void)all_trigger(name2house(house), unit, bright);
-      }
-      write_ti103_command(name2house(house), unit, bright);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "ALN", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, all_lights_on, NONE);
-	  (void)all_trigger(name2house(house), unit, all_lights_on);
-      }
-      write_ti103_command(name2house(house), unit, all_lights_on);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "ALF", 3) == 0) {
-      if (tty == -1) {
-	  (void)function_trigger(name2house(house), unit, all_lights_off, NONE);
-	  (void)all_trigger(name2house(house), unit, all_lights_off);
-      }
-      write_ti103_command(name2house(house), unit, all_lights_off);
-      cp += 2;			/* all except last char */
-    } else if (strncmp(cp, "UND", 3) == 0) {
-      states[name2house(house)][unit] = undefined;
-      cp += 2;			/* all except last char */
-    } else if (*cp >= 'A' && *cp <= 'P') {
-      house = *cp;
-      continue;
-    } else if (isdigit(*cp)) {
-      unit = atoi(cp);
-      cp = skip_digits(cp);
-      cp--;			/* adjust for incr. in loop */
-    }
+static reload_rule *
+reload_find (int house, int unit, func_value func, when_t when) {
+  reload_rule	*rule;
+
+  for (rule = reload_rules; rule; rule = rule->next) {
+    if (rule->house == house && rule->unit == unit && rule->when == when &&
+	(when == NEVER || rule->func == func))
+      return rule;
   }
+  return NULL;
 }
 
 
+static boolean
+reload_same (x10_trigger *trigger, reload_rule *rule) {
+
+  return ((trigger->argv != NULL) == rule->exec &&
+	  strcmp(trigger->command ? trigger->command : "",
+		 rule->command ? rule->command : "") == 0 &&
+	  trigger->opts.remote == rule->opts.remote &&
+	  trigger->opts.rate == rule->opts.rate &&
+	  trigger->opts.per == rule->opts.per);
+}
 
-void
-read_stdin (void) {
-  char	buffer[128];
-  int	buflen;
-  
-  if (fgets(buffer, sizeof(buffer), stdin_file) == NULL) {
-    if (feof(stdin_file)) {
-      fprintf(log_file, "Pipe input ended\n");
-      clearerr(stdin_file);
+
+/*
+ * Make the live triggers and descriptions match the staged ones.
+ */
+static void
+reload_apply (void) {
+  x10_trigger	*trigger, *next;
+  reload_rule	*rule;
+  int		h, u;
+  int		added, changed, removed, descs;
+
+  added = changed = removed = descs = 0;
+  save_loading = TRUE;		/* they're what's in the file */
+
+  for (trigger = trigger_list; trigger; trigger = next) {
+    next = trigger->next;
+    if (!reload_find(trigger->house, trigger->unit, trigger->function,
+		     trigger->when)) {
+      free_trigger_command(trigger);
+      remove_trigger(trigger);
+      removed++;
     }
-    return;
   }
 
-  /* Remove the '\n' from the end */
-  buflen = strlen(buffer);
+  while ((rule = reload_rules) != NULL) {
+    reload_rules = rule->next;
 
-  if (buffer[buflen-1] == '\n') {
-    buffer[buflen-1] = '\0';
+    trigger = find_trigger(rule->house, rule->unit, rule->func, rule->when);
+    if (trigger && (trigger->house != rule->house ||
+		    trigger->unit != rule->unit ||
+		    trigger->when != rule->when ||
+		    (rule->when != NEVER && trigger->function != rule->func))) {
+      trigger = NULL;
+    }
+    if (!trigger || !reload_same(trigger, rule)) {
+      if (trigger) {
+	free_trigger_command(trigger);
+	remove_trigger(trigger);
+	changed++;
+      } else {
+	added++;
+      }
+      add_trigger_opts(rule->house, rule->unit, rule->func, rule->when,
+		       rule->command, rule->exec, &rule->opts);
+    }
+    free(rule->command);
+    free(rule);
   }
 
-  fprintf(log_file, "Read command: '%s'\n", buffer);
-  fflush(log_file);
+  for (h = 0; h <= 16; h++) {
+    for (u = 0; u <= 16; u++) {
+      if (reload_descs[h][u]) {
+	if (!desc_set[h][u] ||
+	    strcmp(x10_description(h, u), reload_descs[h][u]) != 0) {
+	  add_desc(h, u, reload_descs[h][u]);
+	  descs++;
+	}
+	free(reload_descs[h][u]);
+	reload_descs[h][u] = NULL;
+      } else if (desc_set[h][u]) {
+	remove_desc(h, u);
+	descs++;
+      }
+    }
+  }
 
-  parse_stdin(buffer);
+  save_loading = FALSE;
+  fprintf(log_file, "Reloaded '%s': %d added, %d changed, %d removed, %d descriptions\n",
+	  reload_path(), added, changed, removed, descs);
 }
 
 
+/*
+ * Read the commands file's rules into the staging list and apply
+ * the differences.  Nothing live is touched until it's all read.
+ */
 static void
-read_commands (char *com_file) {
-  FILE	*com;
-  char	buffer[128];
-  int	buflen;
+reload_commands (void) {
+  struct stat	st;
+  FILE		*com;
+  char		*buffer;
+  size_t	size;
+  ssize_t	buflen;
+
+  if (save_pid > 0) {		/* wait for our own save */
+    arm_timer(reload_timer_fd, RELOAD_DELAY, FALSE);
+    return;
+  }
+  if (!reload_path() || stat(reload_path(), &st) == -1)
+    return;
+  if (st.st_ino == reload_known.st_ino &&
+      st.st_size == reload_known.st_size &&
+      st.st_mtim.tv_sec == reload_known.st_mtim.tv_sec &&
+      st.st_mtim.tv_nsec == reload_known.st_mtim.tv_nsec)
+    return;			/* nothing new */
 
-  com = fopen(com_file, "r");
+  com = fopen(reload_path(), "r");
   if (!com) {
     return;
   }
 
-  while (fgets(buffer, sizeof(buffer), com) != NULL) {
-    /* Remove the '\n' from the end */
-    buflen = strlen(buffer);
-    
+  reload_staging = TRUE;
+  buffer = NULL;
+  size = 0;
+  while ((buflen = getline(&buffer, &size, com)) > 0) {
     if (buffer[buflen-1] == '\n') {
       buffer[buflen-1] = '\0';
     }
-    
-    fprintf(log_file, "Read command from file : '%s'\n", buffer);
-    fflush(log_file);
-    
-    parse_stdin(buffer);
+    if (is_rule_command(buffer)) {
+      parse_stdin(buffer);
+    }
   }
-
+  free(buffer);
+  reload_staging = FALSE;
   fclose(com);
+
+  reload_apply();
+  reload_known = st;
+  reloads++;
 }
 
 
 int
 main (int argc, char **argv) {
-  fd_set	*readfds;
-  time_t	t, last_t;
+  struct epoll_event	events[MAX_EPOLL_EVENTS];
+  int			nevents;
+  int			i;
+  int			fd;
+  time_t		t;
+  control_client	*client;
 
   init();
 
@@ -1892,38 +6402,95 @@ main (int argc, char **argv) {
   /*
    * Open the device
    */
-  tty = init_ti103();
+  connect_ti103();
 
   setuid(70);			/* setuid to _www */
 
   get_ti103_status(0);
 
   if (argc > 1) {
+    commands_read = argv[1];
     read_commands(argv[1]);
   }
+  reload_watch();
 
   /*
-   * Read buffer
+   * Commands come in on stdin.  If stdin can't be watched (it's
+   * a plain file, say) just read it all now.
    */
-  time(&last_t);
-  while (TRUE) {
-    if (tty == -1) {
-      /* Try opening it again */
-      tty = init_ti103();
-    }
-    readfds = check_input();
+  fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+  if (!reactor_add(STDIN_FILENO, EPOLLIN | EPOLLET)) {
+    read_stdin();
+  }
 
-    if (tty != -1 && FD_ISSET(tty, readfds)) {
-      read_ti103(FALSE);
-    }
-    if (FD_ISSET(STDIN_FILENO, readfds)) {
-      read_stdin();
+  /*
+   * Wait for something to happen
+   */
+  while (TRUE) {
+    nevents = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+    if (nevents < 0) {
+      if (errno != EINTR) {
+	fprintf(log_file, "! epoll_wait failed - errno=%d\n", errno);
+      }
+      continue;
     }
 
-    time(&t);
-    if (t - last_t > 2) {
-      get_ti103_status(0);
-      last_t = t;
+    for (i = 0; i < nevents; i++) {
+      fd = events[i].data.fd;
+
+      if (fd == signal_fd) {
+	read_signals();
+      } else if (fd == poll_timer_fd) {
+	ack_timer(poll_timer_fd);
+	get_ti103_status(0);
+	schedule_poll();
+      } else if (fd == reconnect_timer_fd) {
+	ack_timer(reconnect_timer_fd);
+	if (tty == -1) {
+	  connect_ti103();
+	}
+      } else if (inotify_fd != -1 && fd == inotify_fd) {
+	reload_events();
+      } else if (fd == reload_timer_fd) {
+	ack_timer(reload_timer_fd);
+	reload_commands();
+      } else if (fd == save_timer_fd) {
+	ack_timer(save_timer_fd);
+	save_start();
+      } else if (fd == events_timer_fd) {
+	ack_timer(events_timer_fd);
+	events_write();
+      } else if (fd == sched_timer_fd) {
+	ack_timer(sched_timer_fd);
+	send_x10_commands();
+      } else if (fd == verify_timer_fd) {
+	ack_timer(verify_timer_fd);
+	verify_timer();
+      } else if (fd == xact_timer_fd) {
+	ack_timer(xact_timer_fd);
+	xact_timer();
+      } else if (fd == coproc_timer_fd) {
+	ack_timer(coproc_timer_fd);
+	coproc_timer();
+      } else if (coproc_fd != -1 && fd == coproc_fd) {
+	coproc_flush();
+      } else if (control_fd != -1 && fd == control_fd) {
+	control_accept();
+      } else if (fd == STDIN_FILENO) {
+	read_stdin();
+      } else if (tty != -1 && fd == tty) {
+	if (events[i].events & EPOLLIN) {
+	  read_ti103();
+	}
+	if (tty != -1 && (events[i].events & EPOLLOUT)) {
+	  tx_flush();
+	}
+	if (tty != -1 && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+	  hangup_ti103();
+	}
+      } else if ((client = control_find(fd)) != NULL) {
+	control_io(client, events[i].events);
+      }
     }
   }
 }